@@ -3,8 +3,23 @@
 #include <string.h>
 #include <stdbool.h>
 #include <ctype.h>
+#include <stdint.h>
+#include <stddef.h>
 #include <termios.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <poll.h>
+#include <signal.h>
 #include <unistd.h>
+#include <time.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
 
 // constant definitions
 #define MAN "  " // two character long symbol for ordinary checker
@@ -19,12 +34,77 @@
 #define BORDER 100 // background color of board's border
 #define AVAILABLE 101 // background color of board's square if it is available for move
 #define AMBIGUOUS 41 // background color of board's square if it is available for move and can be reached by different routes
+#define CURSOR 44 // background color of board's square under the keyboard cursor
 #define ALLDIRECT 5 // used in board scanning - means that we do not prohibit any direction
-#define DELAY 100000 // amount in microseconds that is to be passed to usleep function
+#define DELAY 100000 // time in microseconds that a step of the animation stays on the screen
+#define MAXBITS 352 // number of bits needed to pack dark squares of the biggest board
+#define BBWORDS ((MAXBITS + 63) / 64) // number of 64-bit words in a bitboard
+#define MAXPATH 32 // number of landing squares that are stored in a move
+#define MAXMOVES 1024 // capacity of move lists
+#define MAXPLY 64 // maximal depth of computer's search
+#define WIN 100000 // score of a won position
+#define MANVALUE 100 // score of a man
+#define KINGVALUE 300 // score of a king
+#define ADVANCEVALUE 2 // score of a man for every row that it has advanced
+#define GUARDVALUE 5 // score of a man that stays on its own last row
+#define EVALPLANES 6 // number of bits of the biggest bonus of a man for its square
+#define EVALPOSITIONS 100000 // default number of positions of the evaluation benchmark
+#define BUDGET 1000 // default time in milliseconds for computer's move
+#define CHECKNODES 256 // number of searched positions between checks of the time (power of two)
+#define RESERVE 2 // time in milliseconds of the move's budget that is kept for stopping the search
+#define MOVESTOGO 30 // number of moves that the remaining time on the game clock is planned for
+#define SLAB 65536 // size in bytes of memory block of move structures arena
+#define MAGIC "CKBS" // first bytes of binary save file
+#define VERSION 1 // version of binary save format
+#define HEADER 8 // size of binary save header in bytes
+#define SAVESIZE 1024 // maximal size of save file in bytes (text file of the biggest board is smaller)
+#define MAXGAME 400 // default number of plies after which a game of the tournament is a draw
+#define OPENING 4 // default number of random plies that every game of the tournament starts with
+#define BOOKPLIES 10 // default number of plies of the opening book
+#define BOOKMARGIN 10 // default difference from the best score of moves that are taken into the opening book
+#define BOOKMAGIC "CKOB" // first bytes of opening book file
+#define BOOKVERSION 2 // version of opening book format
+#define BOOKHEADER 16 // size of opening book file header in bytes
+#define BOOKENTRY 16 // size of opening book entry in bytes: position's hash (8 bytes), move (4 bytes) and its weight (4 bytes)
+#define TBPIECES 6 // maximal number of pieces of endgame tablebase positions
+#define TBMATERIALS 2401 // number of codes of tablebase materials ((TBPIECES + 1) to the power of 4)
+#define TBBLOCK 256 // number of tablebase entries that are compressed together
+#define TBLIMIT (1ULL << 31) // maximal number of entries of one tablebase table
+#define TBLEVELS 253 // number of distances to the end that tablebase entries can store
+#define TBWIN (WIN / 2) // score of a position that is won according to the tablebase (minus plies to the win)
+#define DECIDED (TBWIN - TBLEVELS - MAXPLY) // scores above it (or below minus it) are wins (or losses) at a known number of plies
+#define TBMAGIC "CKTB" // first bytes of tablebase file
+#define TBVERSION 2 // version of tablebase format
+#define TBHEADER 24 // size of tablebase file header in bytes
+#define TBINVALID 254 // tablebase entry of impossible arrangement of pieces
+#define TBUNKNOWN 255 // tablebase entry that is not solved yet
+#define CHUNK 256 // number of positions of the database that are analysed by a thread at once
+#define JOURNALSIZE (1 << 20) // size in bytes of each of two buffers of the game log writer
+#define JOURNALBATCH (64 << 10) // number of buffered bytes of the game log that are written at once
+#define JOURNALPERIOD 1000 // time in milliseconds after which buffered records of the game log are written anyway
+#define RECORDHEADER 7 // size of game log record's header: payload size (2 bytes), kind (1 byte), game number (4 bytes)
+#define OPTIONS 4 // number of main menu options
+#define ESCAPETIME 50 // time in milliseconds to wait for the rest of an escape sequence after Esc
+#define PROMPTLINES 4 // number of lines below the board used by prompts and messages
+#define ORDERHASH (1 << 30) // order of the move from the transposition table
+#define ORDERCAPTURE (1 << 29) // order of captures and promotions (plus value of captured pieces)
+#define ORDERKILLER (1 << 28) // order of killer moves
+#define HISTORYMAX (1 << 27) // limit of history of cutoffs of a move, so that it stays below killers
+#define HASH 16 // default size of transposition table in megabytes
+#define TTSCORE 27 // offset of the score in transposition table entry (lower bits store the move)
+#define TTDEPTH 45 // offset of the depth
+#define TTBOUND 52 // offset of the bound type
+#define TTGENERATION 54 // offset of the search number
 
 // possible types of pieces
 enum piece {nopiece = -1, bman, wman, bking, wking};
 
+// keys that are not characters (read keys are characters or one of these)
+enum key {endkey = -2, nokey = -1, escapekey = 27, upkey = 256, downkey, rightkey, leftkey, otherkey};
+
+// meaning of a score stored in transposition table
+enum bound {nobound, upper, lower, exact};
+
 // struct that represents board's square
 struct square
 {
@@ -34,10 +114,14 @@ struct square
 	// values for square/piece highlighting
 	int bgselection;
 	bool pcselected;
+	bool cursor; // whether the keyboard cursor is on the square
 
 	// pointers to four adjacent squares: 0 - top left, 1 - top right, 2 - bottom right, 3 - bottom left
 	struct square * adjacent[4];
 
+	// bit that represents the square in bitboards
+	int index;
+
 	// additional prohibited directions if square is crossed multiple times
 	bool crossed[4];
 };
@@ -68,131 +152,910 @@ struct chain
 	struct chain * next;
 };
 
-// global variables
-int SIDE; // stores board's side size
-int pieces[2]; // number of black (0) and white(1) pieces
-struct square * board[MAXSIDE][MAXSIDE] = {}; // main board
-struct move * movestart; // global pointer to move struct
-struct chain * chainstart; // global pointer to chain struct
-void * empty; // pointer returned in special cases
-int turn; // indicates whose turn to move
-typedef int (*MovePiece)(struct square *); // pointer to ManMove() and KingMove() functions
-typedef bool (*ScanPiece)(struct square *);
+// struct that stores one bit per dark square
+struct bitboard
+{
+	uint64_t word[BBWORDS];
+};
+
+// struct that describes how dark squares are packed into bitboard bits
+// Squares are numbered as (row * width + col) / 2, where width is side rounded up to odd number,
+// so that every diagonal step is the same bit shift for all rows
+struct layout
+{
+	int side; // board's side size
+	int width; // row stride in cells
+	int bits; // number of bits in use
+	int words; // number of words in use
+	int shift[4]; // bit offsets to adjacent squares in the same order as square's "adjacent" array
+	short index[MAXSIDE][MAXSIDE]; // bit of every dark square (-1 for white squares)
+	signed char row[MAXBITS]; // row of every bit
+	signed char col[MAXBITS]; // column of every bit
+	short adjacent[MAXBITS][4]; // bits of adjacent squares (-1 if there is none)
+	struct bitboard lines[MAXBITS]; // squares on both diagonals that go through every square (including itself)
+	struct bitboard squares; // all dark squares
+	struct bitboard source[4]; // squares that have an adjacent square in respective direction
+	struct bitboard lastrow[2]; // squares where black (0) and white (1) men become kings
+	struct bitboard bonus[2][EVALPLANES]; // squares where the bonus of a man of black (0) and white (1) has the respective bit set
+};
+
+// struct that represents arrangement of pieces
+struct position
+{
+	struct bitboard men[2]; // black (0) and white (1) men
+	struct bitboard kings[2]; // black (0) and white (1) kings
+	int color; // side to move
+	uint64_t hash; // Zobrist hash of pieces, side to move and board size
+};
+
+// struct that describes one complete move of the side to move
+struct flatmove
+{
+	short from; // bit of the starting square
+	short to; // bit of the final square
+	short length; // number of captured pieces (0 for a move without capture)
+	bool promotion; // whether a man becomes a king
+	short path[MAXPATH]; // bits of squares where the piece lands after every capture (only first MAXPATH are stored)
+	struct bitboard captured; // captured pieces
+};
+
+// struct that holds a subtree that is counted by perft threads
+struct perfttask
+{
+	struct position position; // root of the subtree
+	int depth; // remaining depth
+	int root; // index of the root move that leads to the subtree
+	uint64_t nodes; // number of leaf nodes
+};
+
+// struct that holds a share of perft subtrees of one thread
+struct perftworker
+{
+	pthread_t thread;
+	int id; // index of the thread
+	int count; // number of threads
+	struct perftworker * workers; // all threads
+	const struct layout * layout;
+	struct perfttask * tasks; // all subtrees
+	int depth; // depth of the whole tree (for move stack size)
+	atomic_int next; // next own subtree to count, also taken by other threads
+	int end; // end of own subtrees
+};
+
+// struct that holds one position in transposition table
+// Both words are written without locks, the key is stored XORed with the data,
+// so an entry that was torn by simultaneous writes does not match any hash
+struct ttentry
+{
+	_Atomic uint64_t check; // hash XOR data
+	_Atomic uint64_t data; // packed move, score, depth, bound and generation
+};
+
+// struct that holds transposition table shared between searches
+// Every bucket has two entries: the first one keeps the deepest result, the second one keeps the latest one
+struct table
+{
+	struct ttentry * entries;
+	uint64_t mask; // number of buckets minus one
+	int generation; // number of the current search, entries of older searches are replaced first
+};
+
+// struct that holds unpacked transposition table entry
+struct ttdata
+{
+	int move; // key of the best move (-1 if none)
+	int score;
+	int depth;
+	enum bound bound;
+	int generation;
+};
+
+// struct that holds state of computer's search
+struct searcher
+{
+	const struct layout * layout;
+	struct table * table; // transposition table (NULL if none)
+	uint64_t probes; // number of transposition table lookups
+	uint64_t hits; // number of found positions
+	struct flatmove * stack; // move lists for every ply
+	double deadline; // time when search must be stopped (0 - no limit)
+	double soft; // time after which no new iteration is started (0 - no limit)
+	uint64_t nodes; // number of visited positions
+	bool stop; // whether search has run out of time
+	atomic_bool * abort; // set when the main thread has finished the search
+	const struct tablebase * tablebase; // endgame tablebase (NULL if none)
+	uint64_t tbhits; // number of positions found in the tablebase
+	uint64_t cutoffs; // number of searches that failed high
+	uint64_t firstcutoffs; // number of them where the first move was enough
+	int killers[MAXPLY][2]; // keys of the last two simple moves that caused a cutoff at every ply
+	uint32_t * history; // number of cutoffs of simple moves by their starting and final squares (weighted by depth)
+	struct flatmove best; // best move of the last completed iteration
+	int depth; // depth of the last completed iteration
+	int score; // score of the best move
+};
+
+// struct that holds state of a thread that helps computer's search
+struct helper
+{
+	pthread_t thread;
+	int id; // number of the helper (main thread is 0)
+	const struct position * position; // position to search
+	int depth; // depth of the main search
+	struct searcher searcher; // own searcher that shares the table with the main one
+};
+
+// struct that holds state of capture sequences search
+struct jumpscan
+{
+	const struct layout * layout;
+	struct bitboard empty; // squares that can be crossed or landed on
+	struct bitboard enemies; // pieces that can be captured
+	struct bitboard crossed[4]; // squares that a man has already jumped from in respective direction (as "crossed" of squares)
+	int color; // color of the moving piece
+	struct flatmove move; // sequence that is being built
+	struct flatmove * list; // list to fill
+	int capacity; // size of the list
+	int count; // number of found moves
+};
+
+// struct that holds one move of the game record
+struct logmove
+{
+	struct flatmove move;
+	struct bitboard kings; // captured pieces that were kings
+};
+
+// struct that holds state of analysis of the file of binary records that is shared between threads
+struct database
+{
+	struct layout layout;
+	const unsigned char * records; // mapped file
+	size_t size; // size of one record
+	size_t count; // number of records
+	int depth; // depth of search (0 - no search)
+	FILE * output; // sidecar file
+	atomic_size_t next; // next chunk to analyse
+	size_t written; // number of chunks written to output
+	pthread_mutex_t lock; // protects output and written
+	pthread_cond_t done; // signalled when a chunk is written
+	atomic_ullong damaged; // number of records that cannot be decoded
+};
+
+// struct that holds settings and results of the tournament that are shared between threads
+struct tournament
+{
+	int games; // number of games to play
+	int side;
+	int depth; // depth of computer's search
+	int budget; // time in milliseconds for computer's move (0 - no limit)
+	int clock; // time in milliseconds on the game clock of every side (0 - no clock)
+	int increment; // time in milliseconds that is added to the clock after every move
+	int hash; // size in megabytes of the transposition table of every game
+	int plies; // number of plies after which the game is a draw
+	int opening; // number of random plies at the start of every game
+	uint64_t seed; // seed of random openings
+	struct journal * journal; // game log (NULL if none)
+	struct tablebase * tablebase; // endgame tablebase (NULL if none)
+	struct book * book; // opening book of computer's moves (NULL if none)
+	int bookplies; // number of plies whose moves are collected for a new opening book (0 - none)
+	int margin; // difference from the best score of moves that can be collected
+	struct bookentry * entries; // collected moves
+	size_t count, capacity;
+	atomic_int next; // next game to play
+	pthread_mutex_t lock; // protects results
+	int results[3]; // number of games won by black, won by white and drawn
+	uint64_t plays; // number of plies of all games
+	uint64_t nodes; // number of positions searched in all games
+	double * times; // time in seconds of every computer's move
+	size_t moves, space; // number of computer's moves and capacity of times
+	uint64_t depths; // sum of depths of computer's moves
+};
+
+// struct that holds a move of the opening book
+struct bookentry
+{
+	uint64_t hash; // hash of the position
+	uint32_t move; // key of the move (see BookKey())
+	uint32_t weight; // how often the move is chosen
+};
+
+// struct that holds a mapped opening book: entries sorted by hash and move
+struct book
+{
+	const unsigned char * data;
+	size_t size;
+	uint32_t count; // number of entries
+	const unsigned char * entries;
+};
+
+// struct that holds a mapped table of the endgame tablebase
+// Entries are 0 for draws or distance to the end in plies plus one (odd distance - side to move wins, even - loses)
+struct tbfile
+{
+	const unsigned char * data; // mapped file
+	size_t size;
+	uint32_t blocks; // number of compressed blocks
+	const unsigned char * offsets; // offsets of blocks in runs (4 bytes each, one more than blocks)
+	const unsigned char * runs; // compressed entries: value and varint length of every run
+};
+
+// struct that holds endgame tablebase of one board size: one table for every material (numbers of pieces of every type)
+// Position's index is the rank of squares of every piece type as a combination, then side to move
+struct tablebase
+{
+	struct layout layout;
+	char * directory;
+	int squares; // number of dark squares
+	short number[MAXBITS]; // number of every dark square (-1 for unused bits)
+	uint64_t binomial[MAXBITS + 1][TBPIECES + 1];
+	int pieces; // biggest number of pieces of loaded tables
+	int count; // number of loaded tables
+	struct tbfile * files[TBMATERIALS]; // tables by material code (NULL if not loaded)
+};
+
+// struct that holds list of tablebase entries of one distance
+struct tbbucket
+{
+	uint32_t * items;
+	size_t count, capacity;
+};
+
+// struct that holds tablebase generation that is shared between threads
+struct tbgenerator
+{
+	struct tablebase * tablebase;
+	int (* materials)[4]; // materials that can be solved at the same time
+	int count;
+	atomic_int next; // next material to solve
+	pthread_mutex_t lock; // protects output
+	atomic_bool failed;
+};
+
+// instruction sets of batch evaluation
+enum simd {portable, sse, avx2};
+
+// kinds of game log records
+enum entry {started, moved, undone, finished};
+
+// struct that holds writer of game log that is shared by all games of the process
+// Records are added to one buffer while the other one is written to the file by a separate thread
+struct journal
+{
+	int file; // descriptor of the log file
+	char * buffers[2];
+	int active; // buffer that records are added to
+	size_t length; // number of bytes in the active buffer
+	bool closing; // whether the writer must write the rest and stop
+	bool failed; // whether writing to the file has failed
+	atomic_uint games; // number of the next started game
+	uint64_t records; // number of added records
+	uint64_t writes; // number of writes to the file
+	pthread_t thread;
+	pthread_mutex_t lock;
+	pthread_cond_t full; // signalled when there is a batch to write or the log is closed
+	pthread_cond_t space; // signalled when the buffers are swapped
+};
+
+// struct that holds a game of the game log that is being replayed, with positions before every move for undoing
+struct replayed
+{
+	uint32_t id; // number of the game
+	int side; // board's side size
+	int count; // number of played moves
+	int capacity; // number of positions that fit in the array
+	struct position * positions;
+};
+
+// struct that holds memory block of the arena
+struct slab
+{
+	struct slab * next;
+	size_t size; // capacity of data
+	size_t used; // number of allocated bytes
+	max_align_t data[];
+};
+
+// struct that holds memory of move and chain structures of one turn
+// Memory is only taken from the blocks and all of it is given back at once, blocks are kept for next turns
+struct arena
+{
+	struct slab * first;
+	struct slab * current; // block that allocations are taken from
+	uint64_t allocations; // number of allocated structures
+	uint64_t resets; // number of times the arena was emptied
+	uint64_t heap; // number of blocks requested from the system
+	size_t peak; // biggest number of bytes used in one turn
+	size_t used; // number of bytes used in the current turn
+};
+
+// struct that holds what is shown in board's square
+struct cell
+{
+	signed char type; // type of piece
+	bool pcselected;
+	signed char bgselection; // 0 - not selected, 1 - available, 2 - ambiguous
+	bool cursor;
+};
+
+// struct that holds text of the board that is written to the terminal at once
+struct frame
+{
+	char * data;
+	size_t length;
+	int bg, fg; // colors that are currently set (-1 if unknown)
+	bool drawn; // whether the board is on the screen, so that only changed squares need to be printed
+	int rows, columns; // terminal size when the board was printed
+	struct cell shadow[MAXSIDE][MAXSIDE]; // squares as they are on the screen
+};
+
+// struct that holds state of the terminal input that is shared by the whole process
+struct terminal
+{
+	bool raw; // whether the terminal is in raw mode
+	struct termios saved; // settings to restore
+	unsigned char buffer[256]; // bytes that are read but not decoded yet
+	int start, length;
+};
+
+// struct that holds one step of the animation: the board or the text below it
+struct step
+{
+	long hold; // time in microseconds that the step stays on the screen
+	bool board; // whether the step shows the board or the text
+	struct cell cells[MAXSIDE][MAXSIDE];
+	char text[128];
+};
+
+// struct that holds steps that are waiting to be shown, so that the game never sleeps
+// Steps are shown when their time comes while the game waits for the player
+struct animation
+{
+	bool enabled; // whether steps are shown one by one (otherwise they are printed at once)
+	struct step * steps;
+	int count, capacity;
+	int next; // first step that is not shown yet
+	double due; // time when the shown step is over
+};
+
+// struct that holds complete state of one game, so that any number of games can be played independently
+struct game
+{
+	int side; // stores board's side size
+	int pieces[2]; // number of black (0) and white(1) pieces
+	int turn; // indicates whose turn to move
+	struct square * board[MAXSIDE][MAXSIDE]; // main board
+	struct layout layout; // packing of board's squares into bits
+	struct position position; // pieces on the board
+	struct bitboard capturers[2]; // black (0) and white (1) pieces that are able to capture
+	struct bitboard movers[2]; // black (0) and white (1) pieces that are able to move without capture
+	struct move * movestart; // pointer to move struct
+	struct chain * chainstart; // pointer to chain struct
+	struct arena arena; // memory of move and chain structs
+	struct logmove * log; // moves of the game
+	int logcount; // number of played moves
+	int logsize; // number of recorded moves (bigger than logcount if some moves were undone)
+	int logcapacity; // size of log
+	struct position start; // position before the first move of the log
+	struct logmove pending; // move that is being made by the player
+	bool moving; // whether the player has picked a piece
+	bool history; // whether the player has undone or redone moves instead of moving
+	struct journal * journal; // writer of the game log (NULL if the game is not logged)
+	uint32_t id; // number of the game in the log
+	struct square empty; // square returned in special cases
+	bool computer[2]; // whether black (0) and white (1) pieces are moved by computer
+	int depth; // maximal depth of computer's search
+	int budget; // time in milliseconds for computer's move (0 - no limit)
+	bool clocked; // whether computer's time is taken from the game clock
+	int clock[2]; // remaining time in milliseconds of black (0) and white (1) on the game clock
+	int increment; // time in milliseconds that is added to the clock after every move
+	int lastdepth; // depth of the search of computer's last move
+	uint64_t lastnodes; // number of positions searched for computer's last move
+	double lasttime; // time in seconds that computer's last move took
+	struct table * table; // computer's transposition table
+	struct tablebase * tablebase; // endgame tablebase of computer's search (NULL if none)
+	struct book * book; // opening book of computer's moves (NULL if none)
+	uint64_t random; // state of random choice of book moves
+	int threads; // number of threads of computer's search
+	struct frame frame; // buffer for printing the board
+	bool headless; // whether the game is played without the terminal (nothing is printed and there are no pauses)
+	struct animation animation; // steps of moves and messages that are shown with pauses
+	struct square * cursor; // square under the keyboard cursor (NULL if the cursor is not shown)
+	uint64_t nodes; // number of positions searched by computer
+};
+
+typedef int (*MovePiece)(struct game *, struct square *); // pointer to ManMove() and KingMove() functions
+typedef bool (*ScanPiece)(struct game *, struct square *);
 
 // function prototypes
 int Menu();
-int Save();
-int Load();
-void ClearBoard();
-bool IsStucked(int pcolor);
-bool SimpleMoveScan(struct square * piece);
-int Move(int pcolor);
-int MoveKing(struct square * piece);
-bool KingSimpleCaptureScan(struct square * piece);
-int KingCaptureScan(struct square * piece);
-struct square * KingEnemyScan(struct square * pointer, int direction, int enemy);
-struct square * KingCapture(struct square * piece);
-int KingMoveScan(struct square * piece);
-int MoveMan(struct square *);
-struct square * ManCapture(struct square * piece);
-int Search(struct square * square, struct move * entry, struct chain * chain, int prohibited);
-bool ManCaptureScan(struct square * current, struct move * entry, int enemy, int prohibited);
-bool ManSimpleCaptureScan(struct square * square);
-bool MustCapture(int color);
+int Save(struct game * game);
+int Load(struct game * game);
+int LoadFile(struct game * game, char * filename);
+int SavedSide(char * filename);
+int CheckSide(int side);
+void ClearBoard(struct game * game);
+bool IsStucked(struct game * game, int pcolor);
+bool SimpleMoveScan(struct game * game, struct square * piece);
+int Move(struct game * game, int pcolor);
+int MoveKing(struct game * game, struct square * piece);
+bool KingSimpleCaptureScan(struct game * game, struct square * piece);
+int KingCaptureScan(struct game * game, struct square * piece);
+struct square * KingEnemyScan(struct game * game, struct square * pointer, int direction, int enemy);
+struct square * KingCapture(struct game * game, struct square * piece);
+int KingMoveScan(struct game * game, struct square * piece);
+int MoveMan(struct game * game, struct square *);
+struct square * ManCapture(struct game * game, struct square * piece);
+int Search(struct game * game, struct square * square, struct move * entry, struct chain * chain, int prohibited);
+bool ManCaptureScan(struct arena * arena, struct square * current, struct move * entry, int enemy, int prohibited);
+bool ManSimpleCaptureScan(struct game * game, struct square * square);
+bool MustCapture(struct game * game, int color);
 int MarkSquares(struct move * entry, int prohibited);
 void UnmarkSquares(struct move * entry, int prohibited);
 void ClearMoveList(struct move * entry, int prohibited);
-int CheckSquare(char * s, int * row, int * col);
-struct square * SimpleMove(struct square * piece, struct square * square);
-int SimpleSearch(struct square * piece, struct move * entry, int prohibited);
+int CheckSquare(struct game * game, char * s, int * row, int * col);
+struct square * SimpleMove(struct game * game, struct square * piece, struct square * square);
+int SimpleSearch(struct game * game, struct square * piece, struct move * entry, int prohibited);
 int Opposite(int x);
-struct square * GetSquare(char * prompt);
-void InitializeBoard();
-void InitializePieces();
-void PrintVacantSquare(int bg);
-void PrintSquare(struct square * piece);
-void PrintRow(int row);
-void PrintBoard();
+struct square * GetSquare(struct game * game, char * prompt);
+void InitializeBoard(struct game * game);
+void InitializePieces(struct game * game);
+void PrintVacantSquare(struct frame * frame, int bg);
+void PrintSquare(struct frame * frame, struct square * piece);
+void PrintBackground(struct frame * frame, struct square * square);
+void FrameText(struct frame * frame, const char * text);
+void FrameColor(struct frame * frame, int bg, int fg);
+void FrameLine(struct frame * frame);
+void FrameFlush(struct frame * frame);
+void FrameMove(struct frame * frame, int line, int column);
+struct cell SquareCell(struct square * square);
+void PrintCell(struct game * game, int row, int col, struct cell cell);
+bool UpdateBoard(struct game * game, struct cell cells[MAXSIDE][MAXSIDE]);
+void PrintRow(struct game * game, int row);
+void PrintBoard(struct game * game);
+void InitializeLayout(struct layout * layout, int side);
+struct bitboard Occupied(const struct position * position);
+struct bitboard * PieceMask(struct position * position, enum piece type);
+struct bitboard Ray(const struct layout * layout, struct bitboard start, struct bitboard empty, int direction);
+struct bitboard ManCapturers(const struct layout * layout, const struct position * position, int color, struct bitboard men);
+struct bitboard KingCapturers(const struct layout * layout, const struct position * position, int color, struct bitboard kings);
+struct bitboard Movers(const struct layout * layout, const struct position * position, int color, struct bitboard pieces);
+void PlacePiece(struct game * game, struct square * square, enum piece type);
+struct square * SquareAt(struct game * game, int index);
+int GenerateMoves(const struct layout * layout, const struct position * position, struct flatmove * list, int capacity);
+void AddMove(struct jumpscan * scan);
+void ManJumps(struct jumpscan * scan, int square);
+void KingJumps(struct jumpscan * scan, int square);
+void MakeMove(struct position * position, const struct flatmove * move);
+void SetColor(struct position * position, int color);
+uint64_t HashPosition(const struct layout * layout, const struct position * position);
+int PerftCommand(int argc, char * argv[]);
+uint64_t Perft(const struct layout * layout, const struct position * position, int depth, struct flatmove * stack);
+uint64_t ParallelPerft(const struct layout * layout, const struct position * position, int depth, int threads, uint64_t * divide);
+struct perfttask * SplitPerft(const struct layout * layout, const struct position * position, int depth, int target, int * count);
+void * PerftWorker(void * arg);
+void SquareName(const struct layout * layout, int bit, char * name);
+void MoveName(const struct layout * layout, const struct flatmove * move, char * name);
+double Now();
+int Evaluate(const struct layout * layout, const struct position * position);
+int AlphaBeta(struct searcher * searcher, const struct position * position, int depth, int ply, int alpha, int beta);
+bool FindMove(const struct layout * layout, const struct position * position, int depth, int budget, int threads, struct table * table, const struct tablebase * tablebase, struct searcher * searcher);
+void Deepen(struct searcher * searcher, const struct position * position, int depth, struct flatmove * list, int count, int first);
+void * SearchHelper(void * arg);
+struct table * CreateTable(int megabytes);
+void FreeTable(struct table * table);
+bool ProbeTable(struct table * table, uint64_t hash, struct ttdata * entry);
+void StoreTable(struct table * table, uint64_t hash, int depth, enum bound bound, int score, int move);
+int MoveKey(const struct flatmove * move);
+int BenchCommand(int argc, char * argv[]);
+struct game * SetupGame(char * source);
+void ComputerMove(struct game * game);
+void PlayMove(struct game * game, const struct flatmove * move);
+void * Allocate(struct arena * arena, size_t size);
+void ResetArena(struct arena * arena);
+void FreeArena(struct arena * arena);
+void PrintArena(struct arena * arena);
+void UpdateMobility(struct game * game, int index);
+int DecodeText(const struct layout * layout, struct position * position, const char * data);
+int RecordSize(int side);
+size_t EncodeRecord(const struct layout * layout, const struct position * position, unsigned char * record);
+int DecodeRecord(const struct layout * layout, struct position * position, const unsigned char * record, size_t length);
+uint32_t Crc32(const unsigned char * data, size_t length);
+enum piece PositionPiece(const struct position * position, int bit);
+int AnalyzeCommand(int argc, char * argv[]);
+void * AnalyzeWorker(void * arg);
+size_t AnalyzeRecord(struct database * database, size_t index, const struct position * position, int score, struct flatmove * list, char * line);
+char * ReadFile(char * filename, size_t * length);
+bool EndsWith(char * text, char * suffix);
+void SetPosition(struct game * game, const struct position * position);
+void ResetLog(struct game * game);
+void RecordMove(struct game * game, const struct flatmove * move, struct bitboard kings);
+void LogCapture(struct game * game, struct chain * link);
+void ReplayMove(struct game * game, const struct flatmove * move);
+bool Undo(struct game * game);
+bool Redo(struct game * game);
+int ExportGame(struct game * game, char * filename);
+void WriteFen(const struct layout * layout, const struct position * position, char * text);
+int ImportGame(struct game * game, char * data);
+bool CutCapture(const struct layout * layout, const struct position * position, const struct flatmove * move, const int * squares, int count, struct flatmove * cut);
+int PdnSide(char * data);
+int ParseFen(const struct layout * layout, char * text, struct position * position);
+int ParseSquare(const struct layout * layout, char ** text);
+bool FindPlayedMove(const struct layout * layout, const struct position * position, const int * squares, int count, struct flatmove * list, struct flatmove * move);
+struct journal * OpenJournal(char * filename);
+void CloseJournal(struct journal * journal);
+void AddRecord(struct journal * journal, enum entry kind, uint32_t game, const void * data, size_t size);
+void * JournalWriter(void * arg);
+void LogStart(struct game * game);
+void LogMove(struct game * game, const struct flatmove * move);
+void LogUndo(struct game * game);
+void LogEnd(struct game * game, int winner);
+int MoveSquares(const struct flatmove * move, int * squares);
+int ReplayCommand(int argc, char * argv[]);
+int TournamentCommand(int argc, char * argv[]);
+void * TournamentWorker(void * arg);
+int TournamentGame(struct tournament * tournament, int index);
+void SnapshotBoard(struct game * game, struct cell cells[MAXSIDE][MAXSIDE]);
+struct step * AddStep(struct animation * animation);
+void Animate(struct game * game, long hold);
+void Notify(struct game * game, const char * text, long hold);
+void RunAnimation(struct game * game, bool wait);
+void RawMode();
+void RestoreTerminal();
+void Interrupt(int signal);
+bool WaitInput(int timeout);
+int ReadByte(int timeout);
+int ReadKey(int timeout);
+int ReadLine(char * line, int size, bool keys);
+void MoveCursor(struct game * game, int key);
+void PrintChanges(struct game * game, struct cell cells[MAXSIDE][MAXSIDE]);
+struct tablebase * CreateTablebase(char * directory, int side);
+struct tablebase * LoadTablebase(char * directory, int side);
+void FreeTablebase(struct tablebase * tablebase);
+int MaterialCode(const int * counts);
+void TableName(const struct tablebase * tablebase, const int * counts, char * name, const char * suffix);
+uint64_t TableSize(const struct tablebase * tablebase, const int * counts);
+uint64_t TableIndex(const struct tablebase * tablebase, const int * counts, const struct position * position);
+bool DecodeIndex(const struct tablebase * tablebase, const int * counts, uint64_t index, struct position * position);
+struct tbfile * MapTable(const struct tablebase * tablebase, const int * counts);
+int TableValue(const struct tbfile * file, uint64_t index);
+bool ProbeTablebase(const struct tablebase * tablebase, const struct position * position, int * value);
+int TablebaseScore(int value);
+int TablebaseCommand(int argc, char * argv[]);
+void * TablebaseWorker(void * arg);
+int SolveTable(struct tablebase * tablebase, const int * counts, char * report);
+int Predecessors(const struct tablebase * tablebase, const int * counts, const struct position * position, uint32_t * list);
+void PushEntry(struct tbbucket * bucket, uint32_t index);
+int WriteTable(const struct tablebase * tablebase, const int * counts, const unsigned char * values, uint64_t entries);
+double PlayTournament(struct tournament * tournament, int threads);
+int BookCommand(int argc, char * argv[]);
+struct flatmove BookCandidate(struct game * game, int margin, uint64_t random);
+int CompareEntries(const void * a, const void * b);
+int WriteBook(const char * filename, int side, const struct bookentry * entries, uint32_t count);
+struct book * OpenBook(const char * filename, int side);
+void CloseBook(struct book * book);
+bool ProbeBook(const struct book * book, const struct layout * layout, const struct position * position, uint64_t random, struct flatmove * move);
+int Allot(const struct game * game);
+bool ParseClock(const char * text, int * clock, int * increment);
+int CompareTimes(const void * a, const void * b);
+enum simd BestSimd();
+void EvaluateBatch(const struct layout * layout, const struct position * positions, size_t count, int * scores, enum simd simd);
+void EvaluatePortable(const struct layout * layout, const struct position * positions, size_t count, int * scores);
+int EvaluateCommand(int argc, char * argv[]);
+bool VerifyPerft(struct game * game, const struct position * position, int depth, struct flatmove * stack, struct flatmove * legacy, uint64_t * checked);
+int LegacyMoves(struct game * game, const struct position * position, struct flatmove * list);
+int ListManCaptures(struct move * entry, int prohibited, const struct flatmove * move, struct flatmove * list, int count);
+int ListKingCaptures(struct game * game, struct square * piece, const struct flatmove * move, struct flatmove * list, int count);
+int MissingMove(const struct flatmove * list, int count, const struct flatmove * others, int total);
+uint32_t BookKey(const struct flatmove * move);
+
+struct terminal Terminal; // input of the whole process
+const char * SimdName[3] = {"portable", "sse", "avx2"};
+
+const MovePiece MovePointer[2] = {&MoveMan, &MoveKing};
+const ScanPiece ScanPointer[2] = {&ManSimpleCaptureScan, &KingSimpleCaptureScan};
+
+// CRC-32 (the one of zip and png) of every 4-bit value
+const uint32_t CrcTable[16] = {
+	0x00000000, 0x1db71064, 0x3b6e20c8, 0x26d930ac, 0x76dc4190, 0x6b6b51f4, 0x4db26158, 0x5005713c,
+	0xedb88320, 0xf00f9344, 0xd6d6a3e8, 0xcb61b38c, 0x9b64c2b0, 0x86d3d2d4, 0xa00ae278, 0xbdbdf21c
+};
+
+// Bitboard primitives
+
+static inline bool BitTest(struct bitboard b, int bit)
+{
+	return (b.word[bit >> 6] >> (bit & 63)) & 1;
+}
+
+static inline void BitSet(struct bitboard * b, int bit)
+{
+	b->word[bit >> 6] |= (uint64_t)1 << (bit & 63);
+}
+
+static inline void BitClear(struct bitboard * b, int bit)
+{
+	b->word[bit >> 6] &= ~((uint64_t)1 << (bit & 63));
+}
+
+static inline struct bitboard BitAnd(struct bitboard a, struct bitboard b)
+{
+	for (int i = 0; i < BBWORDS; i++)
+		a.word[i] &= b.word[i];
+	return a;
+}
+
+static inline struct bitboard BitOr(struct bitboard a, struct bitboard b)
+{
+	for (int i = 0; i < BBWORDS; i++)
+		a.word[i] |= b.word[i];
+	return a;
+}
+
+// Bits of a that are not set in b
+static inline struct bitboard BitAndNot(struct bitboard a, struct bitboard b)
+{
+	for (int i = 0; i < BBWORDS; i++)
+		a.word[i] &= ~b.word[i];
+	return a;
+}
+
+static inline bool BitAny(struct bitboard b)
+{
+	uint64_t any = 0;
+	for (int i = 0; i < BBWORDS; i++)
+		any |= b.word[i];
+	return any != 0;
+}
+
+static inline int BitCount(struct bitboard b)
+{
+	int count = 0;
+	for (int i = 0; i < BBWORDS; i++)
+		count += __builtin_popcountll(b.word[i]);
+	return count;
+}
 
-MovePiece MovePointer[2] = {&MoveMan, &MoveKing};
-ScanPiece ScanPointer[2] = {&ManSimpleCaptureScan, &KingSimpleCaptureScan};
+// Clear the lowest set bit and return its number (-1 if there are no bits)
+static inline int BitPop(struct bitboard * b)
+{
+	for (int i = 0; i < BBWORDS; i++)
+	{
+		if (b->word[i] != 0)
+		{
+			int bit = __builtin_ctzll(b->word[i]);
+			b->word[i] &= b->word[i] - 1;
+			return i * 64 + bit;
+		}
+	}
+	return -1;
+}
+
+// Move every bit by the given offset (positive - to higher bits)
+static inline struct bitboard BitShift(struct bitboard b, int shift, int words)
+{
+	struct bitboard r = {};
+	if (shift > 0)
+	{
+		for (int i = words - 1; i > 0; i--)
+			r.word[i] = b.word[i] << shift | b.word[i-1] >> (64 - shift);
+		r.word[0] = b.word[0] << shift;
+	}
+	else
+	{
+		shift = -shift;
+		for (int i = 0; i < words - 1; i++)
+			r.word[i] = b.word[i] >> shift | b.word[i+1] << (64 - shift);
+		r.word[words-1] = b.word[words-1] >> shift;
+	}
+	return r;
+}
+
+// Zobrist keys are computed from their indices instead of being stored, so no table has to be shared
+
+// Mix bits of the number (SplitMix64 finalizer)
+static inline uint64_t Mix(uint64_t x)
+{
+	x += 0x9e3779b97f4a7c15;
+	x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9;
+	x = (x ^ (x >> 27)) * 0x94d049bb133111eb;
+	return x ^ (x >> 31);
+}
+
+// Key of the piece of given type on the given bit
+static inline uint64_t PieceKey(enum piece type, int bit)
+{
+	return Mix((uint64_t)type * MAXBITS + bit);
+}
+
+// Key that is added when white is to move
+static inline uint64_t ColorKey()
+{
+	return Mix(4 * MAXBITS);
+}
+
+// Key of the board size, so that positions of different boards have different hashes
+static inline uint64_t SideKey(int side)
+{
+	return Mix(4 * MAXBITS + 1 + side);
+}
+
+// Move every bit to the adjacent square in the given direction, dropping bits that would leave the board
+static inline struct bitboard BitStep(const struct layout * layout, struct bitboard b, int direction)
+{
+	return BitShift(BitAnd(b, layout->source[direction]), layout->shift[direction], layout->words);
+}
 
 int main(int argc, char * argv[])
 {
-	// check for custom board size
-	if (argc > 1)
+	// check for tool modes
+	if (argc > 1 && strcmp(argv[1], "perft") == 0)
+		return PerftCommand(argc - 2, argv + 2);
+	if (argc > 1 && strcmp(argv[1], "bench") == 0)
+		return BenchCommand(argc - 2, argv + 2);
+	if (argc > 1 && strcmp(argv[1], "analyze") == 0)
+		return AnalyzeCommand(argc - 2, argv + 2);
+	if (argc > 1 && strcmp(argv[1], "replay") == 0)
+		return ReplayCommand(argc - 2, argv + 2);
+	if (argc > 1 && strcmp(argv[1], "tournament") == 0)
+		return TournamentCommand(argc - 2, argv + 2);
+	if (argc > 1 && strcmp(argv[1], "tablebase") == 0)
+		return TablebaseCommand(argc - 2, argv + 2);
+	if (argc > 1 && strcmp(argv[1], "book") == 0)
+		return BookCommand(argc - 2, argv + 2);
+	if (argc > 1 && strcmp(argv[1], "evaluate") == 0)
+		return EvaluateCommand(argc - 2, argv + 2);
+
+	struct game * game = calloc(1, sizeof(struct game));
+	game->side = 8;
+	game->depth = MAXPLY;
+	game->budget = BUDGET;
+	int hash = HASH;
+	bool timed = false;
+	game->threads = 1;
+	char * logname = NULL, * directory = NULL, * bookname = NULL, * clock = NULL;
+
+	// check for custom board size and computer's settings
+	for (int i = 1; i < argc; i++)
+	{
+		if (strcmp(argv[i], "--depth") == 0 && i + 1 < argc)
+			game->depth = atoi(argv[++i]);
+		else if (strcmp(argv[i], "--time") == 0 && i + 1 < argc)
+		{
+			game->budget = atoi(argv[++i]);
+			timed = true;
+		}
+		else if (strcmp(argv[i], "--hash") == 0 && i + 1 < argc)
+			hash = atoi(argv[++i]);
+		else if (strcmp(argv[i], "--threads") == 0 && i + 1 < argc)
+			game->threads = atoi(argv[++i]);
+		else if (strcmp(argv[i], "--log") == 0 && i + 1 < argc)
+			logname = argv[++i];
+		else if (strcmp(argv[i], "--tablebase") == 0 && i + 1 < argc)
+			directory = argv[++i];
+		else if (strcmp(argv[i], "--book") == 0 && i + 1 < argc)
+			bookname = argv[++i];
+		else if (strcmp(argv[i], "--clock") == 0 && i + 1 < argc)
+			clock = argv[++i];
+		else
+			game->side = atoi(argv[i]);
+	}
+	if (game->depth < 1 || game->depth > MAXPLY)
+		game->depth = MAXPLY;
+	if (game->threads < 1)
+		game->threads = 1;
+	if (CheckSide(game->side))
+	{
+		free(game);
+		return 1;
+	}
+	// With the game clock, --time is only the limit of one move
+	if (clock != NULL)
 	{
-		SIDE = atoi(argv[1]);
-		if (SIDE > MAXSIDE)
+		if (!ParseClock(clock, &game->clock[0], &game->increment))
 		{
-			fprintf(stderr, "Board cannot be more than 26 cells per side\n");
+			fprintf(stderr, "Wrong clock %s (MS or MS+MS is expected)\n", clock);
+			free(game);
 			return 1;
 		}
-		if (SIDE < 4)
+		game->clock[1] = game->clock[0];
+		game->clocked = true;
+		if (!timed)
+			game->budget = 0;
+	}
+	if (logname != NULL)
+	{
+		game->journal = OpenJournal(logname);
+		if (game->journal == NULL)
 		{
-			fprintf(stderr, "Board cannot be less than 4 cells per side\n");
-			return 1;	
+			fprintf(stderr, "Couldn't open log %s\n", logname);
+			free(game);
+			return 1;
 		}
+		game->id = atomic_fetch_add(&game->journal->games, 1);
 	}
-	else
-		SIDE = 8;
+	game->table = CreateTable(hash);
+	if (directory != NULL)
+		game->tablebase = LoadTablebase(directory, game->side);
+	if (bookname != NULL)
+		game->book = OpenBook(bookname, game->side);
+	game->random = Mix((uint64_t)(Now() * 1000000) ^ getpid());
+	// Scripted games (with redirected input or output) are played without pauses
+	game->animation.enabled = isatty(STDIN_FILENO) && isatty(STDOUT_FILENO);
+	RawMode();
 
 	// Initialize squares without pieces and print empty board
-	InitializeBoard();
-	PrintBoard();
+	InitializeBoard(game);
+	PrintBoard(game);
 	
 	// Select menu option
 	int mode = Menu();
 	// Exit
-	if (mode == 2)
+	if (mode == 3)
 	{
-		ClearBoard();
+		CloseJournal(game->journal);
+		ClearBoard(game);
+		FreeTable(game->table);
+		FreeTablebase(game->tablebase);
+		CloseBook(game->book);
+		free(game);
 		return 0;
 	}
 	// New
-	if (mode == 0)
-		InitializePieces();
-	// Load
+	if (mode == 0 || mode == 1)
+		InitializePieces(game);
+	// vs Computer (computer plays black)
 	if (mode == 1)
+		game->computer[0] = true;
+	// Load
+	if (mode == 2)
 	{
 		printf("\e[s");
 		while (true)
 		{
+			RunAnimation(game, true);
 			printf("\e[u\e[J");
-			int load = Load();
+			int load = Load(game);
 			if (load == 0)
 				break;
 			if (load == 1)
-			{
-				printf("Couldn't open savefile\n");
-				usleep(DELAY * 10);
-				continue;
-			}
+				Notify(game, "Couldn't open savefile\n", DELAY * 10);
 			if (load == 2)
-			{
-				printf("Savefile has different board size\n");
-				usleep(DELAY * 10);
-				continue;
-			}
+				Notify(game, "Savefile has different board size\n", DELAY * 10);
+			if (load == 3)
+				Notify(game, "Savefile is damaged\n", DELAY * 10);
 		}
 	}
 
 	// While there are pieces of both colors on board
-	while (pieces[0] > 0 && pieces[1] > 0)
+	while (game->pieces[0] > 0 && game->pieces[1] > 0)
 	{
 		// Check if current player is able to move
-		if (IsStucked(turn % 2))
+		if (IsStucked(game, game->turn % 2))
 		{
-			printf("\e[1;92m%s'S VICTORY\e[0m\n", turn % 2 == 0 ? "WHITE" : "BLACK");
+			RunAnimation(game, true);
+			printf("\e[1;92m%s'S VICTORY\e[0m\n", game->turn % 2 == 0 ? "WHITE" : "BLACK");
+			LogEnd(game, (game->turn + 1) % 2);
+			CloseJournal(game->journal);
 			return 0;
 		}
 		// Move and change the turn
-		Move(turn % 2);
-		turn++;
+		if (game->computer[game->turn % 2])
+			ComputerMove(game);
+		else if (Move(game, game->turn % 2) != 0)
+			continue; // moves were undone or redone, the turn is already set
+		game->turn++;
+		SetColor(&game->position, game->turn % 2);
 	}
 
-	printf("\e[1;92m%s'S VICTORY\e[0m\n", pieces[0] == 0 ? "WHITE" : "BLACK");
-	ClearBoard();
+	RunAnimation(game, true);
+	printf("\e[1;92m%s'S VICTORY\e[0m\n", game->pieces[0] == 0 ? "WHITE" : "BLACK");
+	LogEnd(game, game->pieces[0] == 0 ? 1 : 0);
+	CloseJournal(game->journal);
+	ClearBoard(game);
+	FreeTable(game->table);
+	FreeTablebase(game->tablebase);
+	CloseBook(game->book);
+	free(game);
 }
 
 int Menu()
@@ -202,241 +1065,475 @@ int Menu()
 
 	// Option names
 	char * new = "New";
+	char * computer = "vs Computer";
 	char * load = "Load";
 	char * exit = "Exit";
 
-	// Tell terminal to hide input
-	struct termios tty;
-    tcgetattr(STDIN_FILENO, &tty);
-    tty.c_lflag &= ~ECHO;
-    tcsetattr(STDIN_FILENO, TCSANOW, &tty);
-
-    printf("\e[?25l\e[s"); // hide cursor and save its position
+	printf("\e[?25l\e[s"); // hide cursor and save its position
 	while (1)
 	{
 		// Print option names with one highlighted
-		printf("%s%s \e[0m", cursor % 3 == 0 ? highlight : "", new);
-		printf("%s%s \e[0m", cursor % 3 == 1 ? highlight : "", load);
-		printf("%s%s \e[0m", cursor % 3 == 2 ? highlight : "", exit);
-
-		system("stty raw"); // force terminal to send input to stdin immediately (not waiting for Enter) 
-		char c = getchar(); // read key
-		system("stty cooked"); // restore terminal
-		
+		printf("%s%s \e[0m", cursor % OPTIONS == 0 ? highlight : "", new);
+		printf("%s%s \e[0m", cursor % OPTIONS == 1 ? highlight : "", computer);
+		printf("%s%s \e[0m", cursor % OPTIONS == 2 ? highlight : "", load);
+		printf("%s%s \e[0m", cursor % OPTIONS == 3 ? highlight : "", exit);
+
+		fflush(stdout);
+		int key = ReadKey(-1); // terminal is in raw mode, so keys come without waiting for Enter
+
 		// If Enter is pressed
-		if (c == 13)
+		if (key == '\r' || key == '\n')
+		{
+			printf("\n");
+			break;
+		}
+		// End of input exits
+		if (key == endkey)
 		{
 			printf("\n");
+			cursor = 3;
 			break;
 		}
-		if (c == 'D') // if Left arrow key is pressed
-			cursor += 2;
-		if (c == 'C') // if right arrow key is pressed
+		if (key == leftkey)
+			cursor += OPTIONS - 1;
+		if (key == rightkey)
 			cursor++;
 
 		printf("\e[2K\e[u"); // clear line and restore cursor position
 	}
 
-	// Tell terminal to show input
-    tty.c_lflag |= ECHO;
-    tcsetattr(STDIN_FILENO, TCSANOW, &tty);
-
-    printf("\e[?25h"); // show cursor
+	printf("\e[?25h"); // show cursor
 
     // return selected option
-    return cursor % 3;
+    return cursor % OPTIONS;
 }
 
 // Save board status to file
-int Save()
+int Save(struct game * game)
 {
 	printf("Enter save name: "); // prompt for input
 	char *extension = ".save"; // set save extension
 	char filename[32]; // string to store filename
-	fgets(filename, sizeof(filename) - sizeof(extension), stdin); // get input
+	ReadLine(filename, sizeof(filename) - sizeof(extension), false); // get input
 	filename[strcspn(filename, "\n")] = 0; // supplant \n with \0
 	if (strlen(filename) == 0) // if just pressed Enter
 		return 1;
 	
 	// Check if the user typed extension manually
-	if (strcmp(extension, filename + strlen(filename) - strlen(extension)))
+	if (!EndsWith(filename, extension) && !EndsWith(filename, ".pdn"))
 		strcat(filename, extension);
+	// Write the whole game in Portable Draughts Notation
+	if (EndsWith(filename, ".pdn"))
+		return ExportGame(game, filename);
 
-	FILE * file = fopen(filename, "w"); // create file or rewrite existing one
-	fprintf(file, "%d\n", SIDE); // write side size
-	// Write pieces
-	for (int i = 0; i < SIDE; i++)
-	{
-		for (int j = 0; j < SIDE; j++)
-		{
-			fprintf(file, "%d", board[i][j] == NULL || board[i][j]->type == nopiece ? 0 : board[i][j]->type + 1);
-		}
-		fprintf(file, "\n");
-	}
-	fprintf(file, "%d\n%d\n%d\n", pieces[0], pieces[1], turn % 2); // write number of pieces and turn to move
+	FILE * file = fopen(filename, "wb"); // create file or rewrite existing one
+	if (file == NULL)
+		return 1;
+
+	// Write the position as one binary record
+	unsigned char record[SAVESIZE];
+	size_t size = EncodeRecord(&game->layout, &game->position, record);
+	bool written = fwrite(record, 1, size, file) == size;
+	if (fclose(file) != 0 || !written)
+		return 1;
 
-	fclose(file); // close file
+	return 0;
 }
 
 // Restore board status from file
-int Load()
+int Load(struct game * game)
 {
 	printf("Enter save name: "); // prompt for input
 	char *extension = ".save"; // set save extension
 	char filename[32]; // string to store filename
-	fgets(filename, sizeof(filename) - sizeof(extension), stdin); // get input
+	ReadLine(filename, sizeof(filename) - sizeof(extension), false); // get input
 	filename[strcspn(filename, "\n")] = 0; // supplant \n with \0
 	if (strlen(filename) == 0) // if just pressed Enter
 		return 1;
 
 	// Check if the user typed extension manually
-	if (strcmp(extension, filename + strlen(filename) - strlen(extension)))
+	if (!EndsWith(filename, extension) && !EndsWith(filename, ".pdn"))
 		strcat(filename, extension);
 
-	// Try to open a file
-	FILE * file = fopen(filename, "r");
-	if (file == NULL) // if couldn't open (most likely, file doesn't exist)
+	return LoadFile(game, filename);
+}
+
+// Restore board status from the file with given name (binary or text save or game in Portable Draughts Notation)
+// Returns 1 if the file cannot be opened, 2 if it has different board size and 3 if it is damaged
+int LoadFile(struct game * game, char * filename)
+{
+	// Read the whole file at once
+	size_t length;
+	char * data = ReadFile(filename, &length);
+	if (data == NULL) // if couldn't open (most likely, file doesn't exist)
 		return 1;
 
-	// Read board size and check if it is the same as current's
-	int side;
-	fscanf(file, "%d", &side);
-	if (side != SIDE)
+	int result = 0;
+	char * text = data + strspn(data, " \t\r\n");
+	// Move text of Portable Draughts Notation may come without tags
+	if (*text == '[' || EndsWith(filename, ".pdn"))
+		result = ImportGame(game, text);
+	else
 	{
-		fclose(file);
-		return 2;
+		struct position position;
+		result = length >= 4 && memcmp(data, MAGIC, 4) == 0
+			? DecodeRecord(&game->layout, &position, (unsigned char *)data, length)
+			: DecodeText(&game->layout, &position, data);
+		if (result == 0)
+			SetPosition(game, &position);
 	}
-	fseek(file, sizeof(char), SEEK_CUR); // skip '\n' 
 
-	// Read pieces
-	char * c = malloc(sizeof(char));
-	for (int i = 0; i < SIDE; i++)
+	free(data);
+	return result;
+}
+
+// Read the whole file into NUL-terminated buffer that must be freed (NULL if it cannot be read)
+char * ReadFile(char * filename, size_t * length)
+{
+	FILE * file = fopen(filename, "rb");
+	if (file == NULL)
+		return NULL;
+
+	long size = -1;
+	if (fseek(file, 0, SEEK_END) == 0)
+		size = ftell(file);
+	rewind(file);
+	char * data = size >= 0 ? malloc(size + 1) : NULL;
+	if (data == NULL)
 	{
-		for (int j = 0; j < SIDE; j++)
-		{
-			fread(c, sizeof(char), 1, file);
-			int type = atoi(c) - 1;
-			if (type != -1 && board[i][j] != NULL)
-				board[i][j]->type = type;
-		}
-		fseek(file, sizeof(char), SEEK_CUR);
+		fclose(file);
+		return NULL;
 	}
-	// Read number of pieces and current turn
-	fscanf(file, "%d", &pieces[0]);
-	fseek(file, sizeof(char), SEEK_CUR);
-	fscanf(file, "%d", &pieces[1]);
-	fseek(file, sizeof(char), SEEK_CUR);
-	fscanf(file, "%d", &turn);
-
-	// Close the file
-	free(c);
+	*length = fread(data, 1, size, file);
+	data[*length] = '\0';
 	fclose(file);
-	return 0;
+	return data;
 }
 
-// Free the board
-void ClearBoard()
+// Check if the text ends with the suffix
+bool EndsWith(char * text, char * suffix)
 {
-	for (int i = 0; i < SIDE; i++)
-	{
-		for (int j = 0; j < SIDE; j++)
-			free(board[i][j]);
-	}
+	size_t length = strlen(text), count = strlen(suffix);
+	return length >= count && strcmp(text + length - count, suffix) == 0;
 }
 
-// Check if the player is able to move
-bool IsStucked(int pcolor)
+// Put pieces of the position on the board and start a new game record from it
+void SetPosition(struct game * game, const struct position * position)
 {
-	for (int i = 0; i < SIDE; i++)
+	for (int i = 0; i < game->layout.bits; i++)
 	{
-		for (int j = 0; j < SIDE; j++)
-		{
-			if (board[i][j] != NULL && board[i][j]->type % 2 == pcolor)
-			{
-				if (SimpleMoveScan(board[i][j]))
-					return false;
-			}
-		}
+		if (game->layout.row[i] != -1)
+			PlacePiece(game, SquareAt(game, i), PositionPiece(position, i));
 	}
-
-	return true;
+	for (int i = 0; i < 2; i++)
+		game->pieces[i] = BitCount(BitOr(game->position.men[i], game->position.kings[i]));
+	game->turn = position->color;
+	SetColor(&game->position, game->turn % 2);
+	ResetLog(game);
 }
 
-// Check if the piece is able to move
-bool SimpleMoveScan(struct square * piece)
+// Read the position from text save: board size, one line of digits per row (0 - empty, piece type + 1 otherwise),
+// numbers of black and white pieces and the side to move
+int DecodeText(const struct layout * layout, struct position * position, const char * data)
 {
-	if (piece == NULL || piece->type == nopiece)
-		return false;
+	memset(position, 0, sizeof(struct position));
+	char * end;
+	long side = strtol(data, &end, 10);
+	if (end == data)
+		return 3;
+	if (side != layout->side)
+		return 2;
 
-	if (ScanPointer[piece->type / 2](piece))
-		return true;
-	
-	int start, end;
-	if (piece->type / 2 == 0)
-	{
-		start = piece->type % 2 == 0 ? 2 : 0;
-		end = start + 2;
-	}
-	else
+	// Read pieces
+	data = end;
+	for (int i = 0; i < layout->side; i++)
 	{
-		start = 0;
-		end = 4;
+		while (isspace((unsigned char)*data))
+			data++;
+		for (int j = 0; j < layout->side; j++, data++)
+		{
+			if (*data < '0' || *data > '4')
+				return 3;
+
+			int type = *data - '0' - 1;
+			int bit = layout->index[i][j];
+			if (type != nopiece && bit != -1)
+				BitSet(PieceMask(position, type), bit);
+		}
 	}
 
-	for (int i = start; i < end; i++)
+	// Skip numbers of pieces (they are counted on the board) and read the side to move
+	long numbers[3];
+	for (int i = 0; i < 3; i++)
 	{
-		if (piece->adjacent[i] != NULL && piece->adjacent[i]->type == nopiece)
-			return true;
+		numbers[i] = strtol(data, &end, 10);
+		if (end == data)
+			return 3;
+		data = end;
 	}
+	position->color = numbers[2] % 2;
+	position->hash = HashPosition(layout, position);
 
-	return false;
+	return 0;
 }
 
-// Pick the piece to move and call respective move function
-int Move(int pcolor)
+// Return size in bytes of binary record of the position on the board with given side
+int RecordSize(int side)
 {
-	PrintBoard();
+	int squares = side * side / 2;
+	return HEADER + (squares * 3 + 7) / 8 + 4;
+}
 
-	printf("\e[1m%s's move\e[0m\n\e[s", pcolor == 0 ? "Black" : "White");
-	int row = 0, col = 0;
-	while (true)
+// Write the position as binary record and return its size
+// Record has fixed size for every board, so that files of many positions can be read at any place:
+// header (magic, version, side, side to move, zero byte), 2 bits per dark square (0 - empty, 1 - black, 2 - white),
+// 1 bit per dark square that is set for kings and CRC-32 of all previous bytes (little-endian)
+size_t EncodeRecord(const struct layout * layout, const struct position * position, unsigned char * record)
+{
+	int size = RecordSize(layout->side);
+	memset(record, 0, size);
+	memcpy(record, MAGIC, 4);
+	record[4] = VERSION;
+	record[5] = layout->side;
+	record[6] = position->color;
+
+	// Go through dark squares in order of rows
+	int squares = layout->side * layout->side / 2;
+	unsigned char * data = record + HEADER;
+	for (int i = 0, square = 0; i < layout->bits; i++)
 	{
-		printf("\e[u\e[J");
-		struct square * piece = GetSquare("Pick a piece: ");
-		// If picked wrong square
-		if (piece == NULL || piece->type == nopiece || piece->type % 2 != pcolor)
-			continue;
-		// If capture must be done and picked piece isn't able to capture
-		if (MustCapture(pcolor) && !ScanPointer[piece->type / 2](piece))
+		if (layout->row[i] == -1)
 			continue;
+
+		enum piece type = PositionPiece(position, i);
+		if (type != nopiece)
+		{
+			int color = type % 2 + 1;
+			data[square / 4] |= color << (square % 4 * 2);
+			if (type / 2 == 1)
+				data[(squares * 2 + square) / 8] |= 1 << ((squares * 2 + square) % 8);
+		}
+		square++;
+	}
+
+	uint32_t crc = Crc32(record, size - 4);
+	for (int i = 0; i < 4; i++)
+		record[size - 4 + i] = crc >> (i * 8);
+
+	return size;
+}
+
+// Read the position from binary record (returns 2 if it is of different board size and 3 if it is damaged)
+int DecodeRecord(const struct layout * layout, struct position * position, const unsigned char * record, size_t length)
+{
+	memset(position, 0, sizeof(struct position));
+	if (length < HEADER || memcmp(record, MAGIC, 4) != 0 || record[4] != VERSION)
+		return 3;
+	if (record[5] != layout->side)
+		return 2;
+
+	int size = RecordSize(layout->side);
+	if (length < (size_t)size)
+		return 3;
+	uint32_t crc = 0;
+	for (int i = 0; i < 4; i++)
+		crc |= (uint32_t)record[size - 4 + i] << (i * 8);
+	if (crc != Crc32(record, size - 4) || record[6] > 1)
+		return 3;
+
+	int squares = layout->side * layout->side / 2;
+	const unsigned char * data = record + HEADER;
+	for (int i = 0, square = 0; i < layout->bits; i++)
+	{
+		if (layout->row[i] == -1)
+			continue;
+
+		int color = (data[square / 4] >> (square % 4 * 2)) & 3;
+		bool king = (data[(squares * 2 + square) / 8] >> ((squares * 2 + square) % 8)) & 1;
+		if (color == 3)
+			return 3;
+		if (color != 0)
+			BitSet(PieceMask(position, color - 1 + king * 2), i);
+		square++;
+	}
+	position->color = record[6];
+	position->hash = HashPosition(layout, position);
+
+	return 0;
+}
+
+// Compute CRC-32 of the data
+uint32_t Crc32(const unsigned char * data, size_t length)
+{
+	uint32_t crc = 0xffffffff;
+	for (size_t i = 0; i < length; i++)
+	{
+		crc ^= data[i];
+		crc = (crc >> 4) ^ CrcTable[crc & 15];
+		crc = (crc >> 4) ^ CrcTable[crc & 15];
+	}
+
+	return ~crc;
+}
+
+// Return type of the piece on the square
+enum piece PositionPiece(const struct position * position, int bit)
+{
+	for (int color = 0; color < 2; color++)
+	{
+		if (BitTest(position->men[color], bit))
+			return color == 0 ? bman : wman;
+		if (BitTest(position->kings[color], bit))
+			return color == 0 ? bking : wking;
+	}
+
+	return nopiece;
+}
+
+// Read board size from the save file (0 if the file cannot be read)
+int SavedSide(char * filename)
+{
+	size_t length;
+	char * data = ReadFile(filename, &length);
+	if (data == NULL)
+		return 0;
+
+	int side;
+	char * text = data + strspn(data, " \t\r\n");
+	if (length >= HEADER && memcmp(data, MAGIC, 4) == 0)
+		side = (unsigned char)data[5];
+	else if (*text == '[' || EndsWith(filename, ".pdn"))
+		side = PdnSide(text);
+	else
+		side = atoi(data);
+	free(data);
+	return side;
+}
+
+// Check if board size is supported and print the reason if it is not
+int CheckSide(int side)
+{
+	if (side > MAXSIDE)
+	{
+		fprintf(stderr, "Board cannot be more than %d cells per side\n", MAXSIDE);
+		return 1;
+	}
+	if (side < MINSIDE)
+	{
+		fprintf(stderr, "Board cannot be less than %d cells per side\n", MINSIDE);
+		return 1;
+	}
+
+	return 0;
+}
+
+// Free the board
+void ClearBoard(struct game * game)
+{
+	for (int i = 0; i < game->side; i++)
+	{
+		for (int j = 0; j < game->side; j++)
+			free(game->board[i][j]);
+	}
+	free(game->frame.data);
+	free(game->animation.steps);
+	game->animation.steps = NULL;
+	game->animation.count = game->animation.capacity = game->animation.next = 0;
+	FreeArena(&game->arena);
+	free(game->log);
+	game->log = NULL;
+	game->logcount = game->logsize = game->logcapacity = 0;
+	game->frame.data = NULL;
+}
+
+// Check if the player is able to move
+bool IsStucked(struct game * game, int pcolor)
+{
+	return !MustCapture(game, pcolor) && !BitAny(game->movers[pcolor]);
+}
+
+// Check if the piece is able to move
+bool SimpleMoveScan(struct game * game, struct square * piece)
+{
+	if (piece == NULL || piece->type == nopiece)
+		return false;
+
+	return BitTest(game->capturers[piece->type % 2], piece->index) || BitTest(game->movers[piece->type % 2], piece->index);
+}
+
+// Pick the piece to move and call respective move function
+int Move(struct game * game, int pcolor)
+{
+	PrintBoard(game);
+
+	printf("\e[1m%s's move\e[0m\n\e[s", pcolor == 0 ? "Black" : "White");
+	int row = 0, col = 0;
+	while (true)
+	{
+		printf("\e[u\e[J");
+		struct square * piece = GetSquare(game, "Pick a piece: ");
+		// If moves were undone or redone
+		if (game->history)
+		{
+			game->history = false;
+			return 1;
+		}
+		// If picked wrong square
+		if (piece == NULL || piece->type == nopiece || piece->type % 2 != pcolor)
+			continue;
+		// If capture must be done and picked piece isn't able to capture
+		if (MustCapture(game, pcolor) && !ScanPointer[piece->type / 2](game, piece))
+			continue;
+		// Start recording the move
+		memset(&game->pending, 0, sizeof(struct logmove));
+		game->pending.move.from = piece->index;
+		struct position before = game->position;
+
 		// If moving is successful
-		if (!MovePointer[piece->type / 2](piece))
+		game->moving = true;
+		bool moved = !MovePointer[piece->type / 2](game, piece);
+		game->moving = false;
+		// Move structures of this attempt are not used anymore
+		ResetArena(&game->arena);
+		if (moved)
+		{
+			// Find where the piece has stopped (it can return to its square after captures)
+			struct flatmove * move = &game->pending.move;
+			struct bitboard arrived = BitAndNot(BitOr(game->position.men[pcolor], game->position.kings[pcolor]),
+				BitOr(before.men[pcolor], before.kings[pcolor]));
+			move->to = BitPop(&arrived);
+			if (move->to == -1)
+				move->to = move->from;
+			move->promotion = BitTest(before.men[pcolor], move->from) && BitTest(game->position.kings[pcolor], move->to);
+			RecordMove(game, move, game->pending.kings);
 			break;
+		}
 	}
 
-	PrintBoard();
+	PrintBoard(game);
+	return 0;
 }
 
 // Move king piece
-int MoveKing(struct square * piece)
+int MoveKing(struct game * game, struct square * piece)
 {
-	movestart = calloc(1, sizeof(struct move));
+	game->movestart = Allocate(&game->arena, sizeof(struct move));
 	int enemy = (piece->type % 2 + 1) % 2;
 
 	// Check if capture must be done and call respective scanning function
-	bool mustcapture = KingSimpleCaptureScan(piece);
+	bool mustcapture = KingSimpleCaptureScan(game, piece);
 	if (mustcapture)
-		KingCaptureScan(piece);
+		KingCaptureScan(game, piece);
 	else
-		KingMoveScan(piece);
+		KingMoveScan(game, piece);
 
-	int movecount = MarkSquares(movestart, ALLDIRECT);	
+	int movecount = MarkSquares(game->movestart, ALLDIRECT);	
 	// If there are available moves
 	if (movecount > 0)
 		piece->pcselected = true;
 	else
 	{
-		ClearMoveList(movestart, ALLDIRECT);
+		ClearMoveList(game->movestart, ALLDIRECT);
 		return 1;
 	}
 
@@ -446,47 +1543,47 @@ int MoveKing(struct square * piece)
 	int result = 0;
 	while (true)
 	{
-		PrintBoard();
+		PrintBoard(game);
 		printf("\e[1m%s's move\e[0m\n\e[s", piece->type % 2 == 0 ? "Black" : "White");
-		dest = GetSquare("Pick destination: ");
+		dest = GetSquare(game, "Pick destination: ");
 		// If picked wrong destination
 		if (dest == NULL || dest->type != nopiece)
 			continue;
 		// If piece have already been moved in previous iterations and player pressed Enter
-		if (dest == empty && result != 0)
+		if (dest == &game->empty && result != 0)
 		{
-			UnmarkSquares(movestart, ALLDIRECT);
-			ClearMoveList(movestart, ALLDIRECT);
+			UnmarkSquares(game->movestart, ALLDIRECT);
+			ClearMoveList(game->movestart, ALLDIRECT);
 			break;
 		}
 		// If picked destination is not an available square
-		if (SimpleSearch(dest, movestart, ALLDIRECT) == 0)
+		if (SimpleSearch(game, dest, game->movestart, ALLDIRECT) == 0)
 			continue;
 
 		// Move
 		if (!mustcapture)
 		{
-			piece = SimpleMove(piece, dest);
-			UnmarkSquares(movestart, ALLDIRECT);
-			ClearMoveList(movestart, ALLDIRECT);
+			piece = SimpleMove(game, piece, dest);
+			UnmarkSquares(game->movestart, ALLDIRECT);
+			ClearMoveList(game->movestart, ALLDIRECT);
 			break;
 		}
 		// Capture
 		else
 		{
-			chainstart = calloc(1, sizeof(struct chain));
-			result = Search(dest, movestart, chainstart, ALLDIRECT);
+			game->chainstart = Allocate(&game->arena, sizeof(struct chain));
+			result = Search(game, dest, game->movestart, game->chainstart, ALLDIRECT);
 			
-			UnmarkSquares(movestart, ALLDIRECT);
-			PrintBoard();
-			piece = KingCapture(piece);
-			ClearMoveList(movestart, ALLDIRECT);
+			UnmarkSquares(game->movestart, ALLDIRECT);
+			PrintBoard(game);
+			piece = KingCapture(game, piece);
+			ClearMoveList(game->movestart, ALLDIRECT);
 			// If there still are available squares
-			if (KingSimpleCaptureScan(piece))
+			if (KingSimpleCaptureScan(game, piece))
 			{
-				movestart = calloc(1,sizeof(struct move));
-				KingCaptureScan(piece);
-				MarkSquares(movestart, ALLDIRECT);
+				game->movestart = Allocate(&game->arena, sizeof(struct move));
+				KingCaptureScan(game, piece);
+				MarkSquares(game->movestart, ALLDIRECT);
 				continue;
 			}
 
@@ -494,69 +1591,44 @@ int MoveKing(struct square * piece)
 		}
 	}
 
-	PrintBoard();
-	usleep(DELAY);
+	Animate(game, DELAY);
 	piece->pcselected = false;
 	return 0;
 }
 
 // Scan if there are capture moves
-bool KingSimpleCaptureScan(struct square * piece)
+bool KingSimpleCaptureScan(struct game * game, struct square * piece)
 {
 	if (piece == NULL || piece->type == nopiece)
 		return false;
 
-	int enemy = (piece->type % 2 + 1) % 2;
-	for (int i = 0; i < 4; i++)
-	{
-		// Go through diagonal untill enemy is found or line is over
-		struct square * pointer = piece->adjacent[i];
-		while (true)
-		{
-			// If pointer has reached the end of the diagonal 
-			if (pointer == NULL || (pointer->type != nopiece && pointer->type % 2 != enemy))
-				break;
-			// If pointer has reached an enemy square
-			else if (pointer->type != nopiece && pointer->type % 2 == enemy)
-			{
-				if (pointer->adjacent[i] != NULL && pointer->adjacent[i]->type == nopiece)
-					return true;
-				else
-					break;
-			}
-			// If pointer is pointing to an empty squa
-			else
-				pointer = pointer->adjacent[i];
-		}
-	}
-
-	return false;
+	return BitTest(game->capturers[piece->type % 2], piece->index);
 }
 
 // Scan for available king-capture squares and build move structure
-int KingCaptureScan(struct square * piece)
+int KingCaptureScan(struct game * game, struct square * piece)
 {
 	int count = 0;
 	int enemy = (piece->type % 2 + 1) % 2;
 	for (int i = 0; i < 4; i++)
 	{
 		// Check if there are enemies on the current diagonal
-		struct square * penemy = KingEnemyScan(piece->adjacent[i], i, enemy);
+		struct square * penemy = KingEnemyScan(game, piece->adjacent[i], i, enemy);
 		if (penemy != NULL && penemy->adjacent[i] != NULL && penemy->adjacent[i]->type == nopiece)
 		{
 			// Write the first move
 			count++;
-			movestart->next[i] = calloc(1, sizeof(struct move));
-			movestart->tocapture[i] = penemy;
+			game->movestart->next[i] = Allocate(&game->arena, sizeof(struct move));
+			game->movestart->tocapture[i] = penemy;
 			struct square * pointer = penemy->adjacent[i];
-			struct move * current = movestart->next[i];
+			struct move * current = game->movestart->next[i];
 			current->square = pointer;
 			pointer = pointer->adjacent[i];
 			// Write next moves
 			while (pointer != NULL && pointer->type == nopiece)
 			{
 				count++;
-				current->next[i] = calloc(1, sizeof(struct move));
+				current->next[i] = Allocate(&game->arena, sizeof(struct move));
 				current->tocapture[i] = penemy;
 				current = current->next[i];
 				current->square = pointer;
@@ -569,46 +1641,49 @@ int KingCaptureScan(struct square * piece)
 }
 
 // Scan for an enemy on the diagonal
-struct square * KingEnemyScan(struct square * pointer, int direction, int enemy)
+struct square * KingEnemyScan(struct game * game, struct square * pointer, int direction, int enemy)
 {
+	if (pointer == NULL)
+		return NULL;
+
+	struct bitboard occupied = Occupied(&game->position);
+	struct bitboard enemies = BitOr(game->position.men[enemy], game->position.kings[enemy]);
 	// Go through the diagonal
-	while (true)
+	for (int i = pointer->index; i != -1; i = game->layout.adjacent[i][direction])
 	{
-		if (pointer == NULL || (pointer->type != nopiece && pointer->type % 2 != enemy))
+		if (BitTest(enemies, i))
+			return SquareAt(game, i);
+		if (BitTest(occupied, i))
 			return NULL;
-		if (pointer->type != nopiece)
-			return pointer;
-
-		pointer = pointer->adjacent[direction];
 	}
+
+	return NULL;
 }
 
 // Perform capture
-struct square * KingCapture(struct square * piece)
+struct square * KingCapture(struct game * game, struct square * piece)
 {
 	// Preparings
 	int count = 0;
-	int index = chainstart->tocapture->type % 2;
-	struct chain * current = chainstart;
-	usleep(DELAY);
-	PrintBoard();
-	pieces[index]--;
+	int index = game->chainstart->tocapture->type % 2;
+	struct chain * current = game->chainstart;
+	Animate(game, DELAY);
+	game->pieces[index]--;
 	// Go through the chain structure
 	while (current != NULL)
 	{
-		piece = SimpleMove(piece, current->square);
-		current->tocapture->type = nopiece;
-		struct chain * tmp = current;
+		piece = SimpleMove(game, piece, current->square);
+		LogCapture(game, current);
+		PlacePiece(game, current->tocapture, nopiece);
 		current = current->next;
-		free(tmp);
 	}
-	chainstart = NULL;
+	game->chainstart = NULL;
 
 	return piece;
 }
 
 // Scan for available squares for move and build move structure
-int KingMoveScan(struct square * piece)
+int KingMoveScan(struct game * game, struct square * piece)
 {
 	int count = 0;
 	for (int i = 0; i < 4; i++)
@@ -617,14 +1692,14 @@ int KingMoveScan(struct square * piece)
 		if (pointer != NULL && pointer->type == nopiece)
 		{
 			count++;
-			movestart->next[i] = calloc(1, sizeof(struct move));
-			struct move * current = movestart->next[i];
+			game->movestart->next[i] = Allocate(&game->arena, sizeof(struct move));
+			struct move * current = game->movestart->next[i];
 			current->square = pointer;
 			pointer = pointer->adjacent[i];
 			while (pointer != NULL && pointer->type == nopiece)
 			{
 				count++;
-				current->next[i] = calloc(1, sizeof(struct move));
+				current->next[i] = Allocate(&game->arena, sizeof(struct move));
 				current = current->next[i];
 				current->square = pointer;
 				pointer = pointer->adjacent[i];
@@ -636,37 +1711,37 @@ int KingMoveScan(struct square * piece)
 }
 
 // Move man piece
-int MoveMan(struct square * piece)
+int MoveMan(struct game * game, struct square * piece)
 {
 	// variables definition/initialization
 	int direction = piece->type % 2 == 0 ? 1 : -1;
-	movestart = calloc(1, sizeof(struct move));
+	game->movestart = Allocate(&game->arena, sizeof(struct move));
 	int enemy = (piece->type % 2 + 1) % 2;
 
 	// Scan for available moves if capture is not mandatory
 	piece->pcselected = true;
-	bool mustcapture = ManSimpleCaptureScan(piece);
+	bool mustcapture = ManSimpleCaptureScan(game, piece);
 	if (!mustcapture)
 	{
-		movestart->square = piece;
+		game->movestart->square = piece;
 		for (int i = direction + 1, max = i + 2; i < max; i++)
 		{
 			if (piece->adjacent[i] != NULL && piece->adjacent[i]->type == nopiece)
 			{
-				movestart->next[i] = calloc(1, sizeof(struct move));
-				movestart->next[i]->square = piece->adjacent[i];
+				game->movestart->next[i] = Allocate(&game->arena, sizeof(struct move));
+				game->movestart->next[i]->square = piece->adjacent[i];
 			}
 		}
 	}
 	else
-		ManCaptureScan(piece, movestart, enemy, ALLDIRECT);
+		ManCaptureScan(&game->arena, piece, game->movestart, enemy, ALLDIRECT);
 
-	int movecount = MarkSquares(movestart, ALLDIRECT);
+	int movecount = MarkSquares(game->movestart, ALLDIRECT);
 	// If there are no available moves
 	if (movecount <= 0)
 	{
 		piece->pcselected = false;
-		ClearMoveList(movestart, ALLDIRECT);
+		ClearMoveList(game->movestart, ALLDIRECT);
 		return 1;
 	}
 	
@@ -677,55 +1752,54 @@ int MoveMan(struct square * piece)
 	int result = 0;
 	while (true)
 	{
-		PrintBoard();
+		PrintBoard(game);
 		printf("\e[1m%s's move\e[0m\n\e[s", piece->type % 2 == 0 ? "Black" : "White");
-		dest = GetSquare("Pick destination: ");
+		dest = GetSquare(game, "Pick destination: ");
 		// If picked wrong destination
 		if (dest == NULL || dest->type != nopiece)
 			continue;
 		// If piece have already been moved in previous iterations and player pressed Enter
-		if (dest == empty && result == -2)
+		if (dest == &game->empty && result == -2)
 		{
-			UnmarkSquares(movestart, ALLDIRECT);
-			ClearMoveList(movestart, ALLDIRECT);
+			UnmarkSquares(game->movestart, ALLDIRECT);
+			ClearMoveList(game->movestart, ALLDIRECT);
 			break;
 		}
 		// If picked destination is not an available square
-		if (SimpleSearch(dest, movestart, ALLDIRECT) == 0)
+		if (SimpleSearch(game, dest, game->movestart, ALLDIRECT) == 0)
 			continue;
 
 		// Move
 		if (!mustcapture)
 		{
-			piece = SimpleMove(piece, dest);
-			UnmarkSquares(movestart, ALLDIRECT);
-			ClearMoveList(movestart, ALLDIRECT);
+			piece = SimpleMove(game, piece, dest);
+			UnmarkSquares(game->movestart, ALLDIRECT);
+			ClearMoveList(game->movestart, ALLDIRECT);
 			break;
 		}
 		// Capture
 		else
 		{
-			chainstart = calloc(1, sizeof(struct chain));
-			result = Search(dest, movestart, chainstart, ALLDIRECT);
+			game->chainstart = Allocate(&game->arena, sizeof(struct chain));
+			result = Search(game, dest, game->movestart, game->chainstart, ALLDIRECT);
 			// If picked ambiguous destination
 			if (result == 3)
 			{
-				printf("You cannot move to ambiguous destination in more than one move away!\n");
-				usleep(10 * DELAY);
+				Notify(game, "You cannot move to ambiguous destination in more than one move away!\n", 10 * DELAY);
 				continue;
 			}
 			else
 			{
-				UnmarkSquares(movestart, ALLDIRECT);
-				PrintBoard();
-				piece = ManCapture(piece);
-				ClearMoveList(movestart, ALLDIRECT);
+				UnmarkSquares(game->movestart, ALLDIRECT);
+				PrintBoard(game);
+				piece = ManCapture(game, piece);
+				ClearMoveList(game->movestart, ALLDIRECT);
 				// If moving through squares one at a time
 				if (result == 2)
 				{
-					movestart = calloc(1,sizeof(struct move));
-					ManCaptureScan(piece, movestart, enemy, ALLDIRECT);
-					MarkSquares(movestart, ALLDIRECT);
+					game->movestart = Allocate(&game->arena, sizeof(struct move));
+					ManCaptureScan(&game->arena, piece, game->movestart, enemy, ALLDIRECT);
+					MarkSquares(game->movestart, ALLDIRECT);
 					continue;
 				}
 
@@ -737,46 +1811,43 @@ int MoveMan(struct square * piece)
 
 	// If reached the end of board
 	if (piece->adjacent[direction+1] == NULL && piece->adjacent[direction+2] == NULL)
-		piece->type += 2; // change piece type from man to king
+		PlacePiece(game, piece, piece->type + 2); // change piece type from man to king
 
-	PrintBoard();
-	usleep(DELAY);
+	Animate(game, DELAY);
 	piece->pcselected = false;
 	return 0;
 }
 
 // Perform capture
-struct square * ManCapture(struct square * piece)
+struct square * ManCapture(struct game * game, struct square * piece)
 {
 	// Preparings
 	int count = 0;
-	int index = chainstart->tocapture->type % 2;
-	struct chain * current = chainstart;
+	int index = game->chainstart->tocapture->type % 2;
+	struct chain * current = game->chainstart;
 	// Go through the chain structure
 	while (current != NULL)
 	{
-		piece = SimpleMove(piece, current->square);	
-		pieces[index]--;
-		current->tocapture->type = nopiece;
-		struct chain * tmp = current;
+		piece = SimpleMove(game, piece, current->square);	
+		game->pieces[index]--;
+		LogCapture(game, current);
+		PlacePiece(game, current->tocapture, nopiece);
 		current = current->next;
-		free(tmp);
-		usleep(DELAY);
-		PrintBoard();
+		Animate(game, DELAY);
 	}
-	chainstart = NULL;
+	game->chainstart = NULL;
 
 	return piece;
 }
 
 // Build chain structure based on move structure
-int Search(struct square * square, struct move * entry, struct chain * chain, int prohibited)
+int Search(struct game * game, struct square * square, struct move * entry, struct chain * chain, int prohibited)
 {
 	if (square == NULL || entry == NULL)
 		return 0;
 
 	// Check if given square is in the move structure
-	int found = SimpleSearch(square, entry, prohibited);
+	int found = SimpleSearch(game, square, entry, prohibited);
 	if (!found)
 		return 0;
 
@@ -787,7 +1858,7 @@ int Search(struct square * square, struct move * entry, struct chain * chain, in
 	{
 		if (i != prohibited)
 		{
-			steps[i] = SimpleSearch(square, entry->next[i], Opposite(i));
+			steps[i] = SimpleSearch(game, square, entry->next[i], Opposite(i));
 			if (steps[i] > 0)
 			{
 				count++;
@@ -812,8 +1883,8 @@ int Search(struct square * square, struct move * entry, struct chain * chain, in
 			else
 				return 1;
 		}
-		chain->next = calloc(1, sizeof(struct chain));
-		Search(square, entry->next[minindex], chain->next, Opposite(minindex));
+		chain->next = Allocate(&game->arena, sizeof(struct chain));
+		Search(game, square, entry->next[minindex], chain->next, Opposite(minindex));
 	}
 	else
 	{
@@ -821,7 +1892,7 @@ int Search(struct square * square, struct move * entry, struct chain * chain, in
 		{
 			chain->square = entry->next[minindex]->square;
 			chain->tocapture = entry->tocapture[minindex];
-			if (entry == movestart)
+			if (entry == game->movestart)
 				return 2;
 			else
 				return 3;
@@ -832,7 +1903,7 @@ int Search(struct square * square, struct move * entry, struct chain * chain, in
 }
 
 // Scan for capture moves and build move srtucture
-bool ManCaptureScan(struct square * current, struct move * entry, int enemy, int prohibited)
+bool ManCaptureScan(struct arena * arena, struct square * current, struct move * entry, int enemy, int prohibited)
 {
 	// Go through all directions
 	bool mustcapture = false;
@@ -849,59 +1920,37 @@ bool ManCaptureScan(struct square * current, struct move * entry, int enemy, int
 				if (current->adjacent[i]->adjacent[i] != NULL && (current->adjacent[i]->adjacent[i]->type == nopiece || current->adjacent[i]->adjacent[i]->pcselected))
 				{
 					mustcapture = true;
-					entry->next[i] = calloc(1, sizeof(struct move));
+					entry->next[i] = Allocate(arena, sizeof(struct move));
 					current->crossed[i] = true;
 					current->adjacent[i]->adjacent[i]->crossed[Opposite(i)] = true;
 					entry->tocapture[i] = current->adjacent[i];
 					int nextprohibited = Opposite(i);
-					ManCaptureScan(current->adjacent[i]->adjacent[i], entry->next[i], enemy, nextprohibited);
+					ManCaptureScan(arena, current->adjacent[i]->adjacent[i], entry->next[i], enemy, nextprohibited);
 					current->crossed[i] = false;	
 				}
 			}
 		}
 	}
 
-	current->crossed[prohibited] = false;
+	if (prohibited != ALLDIRECT)
+		current->crossed[prohibited] = false;
 
 	return mustcapture;
 }
 
 // Scan if there are capture moves
-bool ManSimpleCaptureScan(struct square * square)
+bool ManSimpleCaptureScan(struct game * game, struct square * square)
 {
 	if (square == NULL || square->type == nopiece)
 		return false;
 
-	int enemy = (square->type % 2 + 1) % 2;
-	for (int i = 0; i < 4; i++)
-	{
-		if (square->adjacent[i] != NULL && square->adjacent[i]->type != nopiece && square->adjacent[i]->type % 2 == enemy)
-		{
-			if (square->adjacent[i]->adjacent[i] != NULL && square->adjacent[i]->adjacent[i]->type == nopiece)
-				return true;
-		}
-	}
-
-	return false;
+	return BitTest(game->capturers[square->type % 2], square->index);
 }
 
 // Check if there are capture moves on the board
-bool MustCapture(int color)
+bool MustCapture(struct game * game, int color)
 {
-	for (int i = 0; i < SIDE; i++)
-	{
-		for (int j = 0; j < SIDE; j++)
-		{
-			if (board[i][j] != NULL && board[i][j]->type != nopiece && board[i][j]->type % 2 == color)
-			{
-				// Call respective to the piece type function
-				if (ScanPointer[board[i][j]->type / 2](board[i][j]))
-					return true;
-			}
-		}
-	}
-
-	return false;
+	return BitAny(game->capturers[color]);
 }
 
 // Go through the move structure and mark all squares selected
@@ -944,33 +1993,103 @@ void UnmarkSquares(struct move * entry, int prohibited)
 	}
 }
 
-// Clear move structure
+// Clear move structure (its memory is given back when the arena is reset)
 void ClearMoveList(struct move * entry, int prohibited)
 {
 	if (entry == NULL)
 		return;
 
-	struct move * next[4];
 	for (int i = 0; i < 4; i++)
 	{
-		next[i] = entry->next[i];
 		if (entry->square != NULL)
 			entry->square->crossed[i] = false;
 	}
-	free(entry);
-	entry = NULL;
 
 	// Recursive call
 	for (int i = 0; i < 4; i++)
-		ClearMoveList(next[i], ALLDIRECT);
+		ClearMoveList(entry->next[i], ALLDIRECT);
+}
+
+// Take zeroed memory from the arena, a new block is requested only if all blocks are used
+void * Allocate(struct arena * arena, size_t size)
+{
+	size = (size + sizeof(max_align_t) - 1) / sizeof(max_align_t) * sizeof(max_align_t);
+	struct slab * slab = arena->current;
+	while (slab == NULL || slab->used + size > slab->size)
+	{
+		// Go to the next kept block
+		if (slab != NULL && slab->next != NULL)
+		{
+			slab = slab->next;
+			slab->used = 0;
+			continue;
+		}
+
+		// Request new block
+		size_t capacity = size > SLAB ? size : SLAB;
+		struct slab * new = malloc(sizeof(struct slab) + capacity);
+		if (new == NULL)
+		{
+			fprintf(stderr, "Out of memory\n");
+			exit(1);
+		}
+		new->next = NULL;
+		new->size = capacity;
+		new->used = 0;
+		if (slab == NULL)
+			arena->first = new;
+		else
+			slab->next = new;
+		slab = new;
+		arena->heap++;
+	}
+	arena->current = slab;
+
+	void * pointer = (char *)slab->data + slab->used;
+	slab->used += size;
+	arena->used += size;
+	arena->allocations++;
+	if (arena->used > arena->peak)
+		arena->peak = arena->used;
+	memset(pointer, 0, size);
+	return pointer;
+}
+
+// Give back all memory of the arena at once (blocks after the first are emptied when they are reached)
+void ResetArena(struct arena * arena)
+{
+	if (arena->first != NULL)
+		arena->first->used = 0;
+	arena->current = arena->first;
+	arena->used = 0;
+	arena->resets++;
+}
+
+// Return arena's blocks to the system
+void FreeArena(struct arena * arena)
+{
+	while (arena->first != NULL)
+	{
+		struct slab * next = arena->first->next;
+		free(arena->first);
+		arena->first = next;
+	}
+	memset(arena, 0, sizeof(struct arena));
+}
+
+// Print arena's counters
+void PrintArena(struct arena * arena)
+{
+	printf("Move structures: %llu allocated, %llu resets, %llu blocks from heap, %zu bytes at most per turn\n",
+		(unsigned long long)arena->allocations, (unsigned long long)arena->resets, (unsigned long long)arena->heap, arena->peak);
 }
 
 // Parse given string and find row and col values
-int CheckSquare(char * s, int * row, int * col)
+int CheckSquare(struct game * game, char * s, int * row, int * col)
 {
 	int tmpcol, tmprow;
 	tmpcol = toupper(s[0]) - 'A';
-	if (tmpcol >= SIDE || !isalpha(s[0]))
+	if (tmpcol >= game->side || !isalpha(s[0]))
 		return 1;
 
 	for (int i = 1; s[i] != '\0' && s[i] != '\n'; i++)
@@ -980,25 +2099,25 @@ int CheckSquare(char * s, int * row, int * col)
 	}
 
 	tmprow = atoi(s + 1);
-	if (tmprow > SIDE)
+	if (tmprow > game->side)
 		return 3;
 
 	*col = tmpcol;
-	*row = SIDE - tmprow;
+	*row = game->side - tmprow;
 
 	return 0;
 }
 
 // Change piece types between two squares
-struct square * SimpleMove(struct square * piece, struct square * square)
+struct square * SimpleMove(struct game * game, struct square * piece, struct square * square)
 {
 	if (piece == NULL || piece->type == nopiece)
 		return NULL;
 	if (square == NULL || square->type != nopiece)
 		return NULL;
 
-	square->type = piece->type;
-	piece->type = nopiece;
+	PlacePiece(game, square, piece->type);
+	PlacePiece(game, piece, nopiece);
 	square->pcselected = piece->pcselected;
 	piece->pcselected = false;
 
@@ -1006,12 +2125,12 @@ struct square * SimpleMove(struct square * piece, struct square * square)
 }
 
 // Check if the given square is in the move structure
-int SimpleSearch(struct square * square, struct move * entry, int prohibited)
+int SimpleSearch(struct game * game, struct square * square, struct move * entry, int prohibited)
 {
 	if (square == NULL || entry == NULL)
 		return 0;
 
-	if (square == entry->square && entry != movestart)
+	if (square == entry->square && entry != game->movestart)
 		return 1;
 
 	int steps[4] = {};
@@ -1020,7 +2139,7 @@ int SimpleSearch(struct square * square, struct move * entry, int prohibited)
 	{
 		if (i != prohibited)
 		{
-			steps[i] = SimpleSearch(square, entry->next[i], Opposite(i));
+			steps[i] = SimpleSearch(game, square, entry->next[i], Opposite(i));
 			if (steps[i] > 0)
 			{
 				if (min == 0)
@@ -1043,63 +2162,112 @@ int Opposite(int x)
 }
 
 // Return pointer to a board's square by parsing typed string and process commands
-struct square * GetSquare(char * prompt)
+struct square * GetSquare(struct game * game, char * prompt)
 {
 	int row = 0, col = 0;
 	printf("\e[s");
 	while (true)
 	{
-		printf("%s", prompt);
+		// Let messages of previous attempts stay on the screen for a while
+		RunAnimation(game, true);
+		printf("\e[u\e[J%s", prompt);
 
 		char buff[8];
-		fgets(buff, sizeof(buff), stdin);
-		buff[strcspn(buff, "\n")] = 0;
+		int key = ReadLine(buff, sizeof(buff), true);
+		// Arrow keys move the cursor over the board and space picks the square under it
+		if (key >= upkey && key <= leftkey)
+		{
+			MoveCursor(game, key);
+			continue;
+		}
+		if (key == ' ')
+		{
+			if (game->cursor != NULL)
+				return game->cursor;
+			continue;
+		}
+		// End of input exits
+		if (key == endkey)
+			strcpy(buff, "exit");
 		if(strlen(buff) == 0)
-			return empty;
+			return &game->empty;
 
 		if (strcmp("save", buff) == 0)
 		{
-			if (Save() == 0)
-				printf("Saved\n");
-			else
-				printf("Not Saved\n");
-			usleep(DELAY * 10);
-			printf("\e[u\e[J");
+			Notify(game, Save(game) == 0 ? "Saved\n" : "Not Saved\n", DELAY * 10);
 			continue;
 		}
 		if (strcmp("exit", buff) == 0)
+		{
+			LogEnd(game, 2);
+			CloseJournal(game->journal);
 			exit(0);
-		if (CheckSquare(buff, &row, &col))
+		}
+		if (strcmp("undo", buff) == 0 || strcmp("redo", buff) == 0)
 		{
-			printf("\e[u\e[J");
+			bool undo = buff[0] == 'u';
+			bool done = false;
+			if (game->moving)
+				Notify(game, "Finish the move first\n", DELAY * 10);
+			else
+			{
+				// Moves of the computer are undone and redone together with the player's ones
+				done = undo ? Undo(game) : Redo(game);
+				while (done && game->computer[game->turn % 2] && (undo ? Undo(game) : Redo(game)));
+				if (!done)
+					Notify(game, undo ? "Nothing to undo\n" : "Nothing to redo\n", DELAY * 10);
+			}
+			if (done)
+			{
+				game->history = true;
+				return &game->empty;
+			}
+			continue;
+		}
+		if (strcmp("stats", buff) == 0)
+		{
+			PrintArena(&game->arena);
+			if (game->computer[0] || game->computer[1])
+				printf("Computer's last move: depth %d, %llu nodes, %.1f ms\n", game->lastdepth,
+					(unsigned long long)game->lastnodes, game->lasttime * 1000);
+			Notify(game, "", DELAY * 20);
 			continue;
 		}
+		if (CheckSquare(game, buff, &row, &col))
+			continue;
 
 		break;
 	}
 
-	return board[row][col];	
+	return game->board[row][col];	
 }
 
 // Perform actions that are mandatory for playing
-void InitializeBoard()
+void InitializeBoard(struct game * game)
 {
-	empty = calloc(1, 1);
-	int rows = (4 * SIDE) / 10;
+	int rows = (4 * game->side) / 10;
+	InitializeLayout(&game->layout, game->side);
+	game->position.hash = SideKey(game->side);
+
+	// Every character of the frame takes at most 3 bytes and color switch before it
+	int lines = game->side * LEN + 2, columns = game->side * LEN * 2 + 6;
+	game->frame.data = malloc((size_t)lines * columns * 16 + 64);
+	game->frame.bg = game->frame.fg = -1;
 
 	// Allocate memory for black squares
 	int rowswitch = 0;
 	int colswitch = 0;
-	for (int i = 0; i < SIDE; i++)
+	for (int i = 0; i < game->side; i++)
 	{
 		rowswitch++;
 		colswitch = rowswitch;
-		for (int j = 0; j < SIDE; j++)
+		for (int j = 0; j < game->side; j++)
 		{
 			if (colswitch % 2 == 0)
 			{
-				board[i][j] = calloc(1, sizeof(struct square));
-				board[i][j]->type = nopiece;
+				game->board[i][j] = calloc(1, sizeof(struct square));
+				game->board[i][j]->type = nopiece;
+				game->board[i][j]->index = game->layout.index[i][j];
 			}
 
 			colswitch++;
@@ -1107,26 +2275,26 @@ void InitializeBoard()
 	}
 
 	// Create pointers to adjacent squares
-	for (int i = 0; i < SIDE; i++)
+	for (int i = 0; i < game->side; i++)
 	{
-		for (int j = 0; j < SIDE; j++)
+		for (int j = 0; j < game->side; j++)
 		{
-			if (board[i][j] != NULL)
+			if (game->board[i][j] != NULL)
 			{
 				if (i > 0)
 				{
 					if (j > 0)
-						board[i][j]->adjacent[0] = board[i-1][j-1];
-					if (j < SIDE-1)
-						board[i][j]->adjacent[1] = board[i-1][j+1];
+						game->board[i][j]->adjacent[0] = game->board[i-1][j-1];
+					if (j < game->side-1)
+						game->board[i][j]->adjacent[1] = game->board[i-1][j+1];
 				}
 
-				if (i < SIDE - 1)
+				if (i < game->side - 1)
 				{
 					if (j > 0)
-						board[i][j]->adjacent[3] = board[i+1][j-1];
-					if (j < SIDE-1)
-						board[i][j]->adjacent[2] = board[i+1][j+1];
+						game->board[i][j]->adjacent[3] = game->board[i+1][j-1];
+					if (j < game->side-1)
+						game->board[i][j]->adjacent[2] = game->board[i+1][j+1];
 				}
 			}	
 		}
@@ -1134,172 +2302,4499 @@ void InitializeBoard()
 }
 
 // Add pieces to the board
-void InitializePieces()
+void InitializePieces(struct game * game)
 {
-	turn = 1;
-	int rows = (4 * SIDE) / 10;
+	game->turn = 1;
+	SetColor(&game->position, game->turn % 2);
+	int rows = (4 * game->side) / 10;
 	int rowswitch = 0;
 	int colswitch = 0;
-	for (int i = 0; i < SIDE; i++)
+	for (int i = 0; i < game->side; i++)
 	{
 		rowswitch++;
 		colswitch = rowswitch;
-		for (int j = 0; j < SIDE; j++)
+		for (int j = 0; j < game->side; j++)
 		{
 			if (colswitch % 2 == 0)
 			{
-				board[i][j]->type = (i < rows || i >= SIDE - rows) ? bman : nopiece;
-				if (i >= SIDE - rows)
-					board[i][j]->type = wman;
+				enum piece type = (i < rows || i >= game->side - rows) ? bman : nopiece;
+				if (i >= game->side - rows)
+					type = wman;
+				PlacePiece(game, game->board[i][j], type);
 
-				if (board[i][j]->type != nopiece)
-					pieces[board[i][j]->type % 2]++;
+				if (game->board[i][j]->type != nopiece)
+					game->pieces[game->board[i][j]->type % 2]++;
 			}
 
 			colswitch++;
 		}
 	}
+	ResetLog(game);
 }
 
-// Print square without piece
-void PrintVacantSquare(int bg)
+// Add text to the frame
+void FrameText(struct frame * frame, const char * text)
 {
-	for (int i = 0; i < LEN * 2; i++)
-		printf("\e[%dm \e[0m", bg);
+	size_t length = strlen(text);
+	memcpy(frame->data + frame->length, text, length);
+	frame->length += length;
 }
 
-// Print square with piece
-void PrintSquare(struct square * piece)
+// Switch colors of the following text (fg 0 - default foreground), nothing is added if they are already set
+void FrameColor(struct frame * frame, int bg, int fg)
 {
-	printf("\e[%dm", BLACKBG);
-	for (int i = 0; i < LEN - 1; i++)
-		printf(" ");
+	if (frame->bg == bg && frame->fg == fg)
+		return;
 
-	int bg = piece->pcselected ? AVAILABLE : (piece->type % 2 == 0 ? BLACK : WHITE);
-	int fg = bg == WHITE ? BLACK-10 : WHITE-10;
-	char * fill = piece->type / 2 == 0 ? MAN : KING;
-	printf("\e[%d;%dm%s\e[0m", bg, fg, fill);
+	char code[16];
+	int length = fg != 0 ? sprintf(code, "\e[0;%d;%dm", bg, fg) : sprintf(code, "\e[0;%dm", bg);
+	memcpy(frame->data + frame->length, code, length);
+	frame->length += length;
+	frame->bg = bg;
+	frame->fg = fg;
+}
 
-	printf("\e[%dm", BLACKBG);
-	for (int i = 0; i < LEN - 1; i++)
-		printf(" ");
+// Reset colors and go to the next line
+void FrameLine(struct frame * frame)
+{
+	FrameText(frame, "\e[0m\n");
+	frame->bg = frame->fg = -1;
+}
+
+// Write the whole frame to the terminal at once
+void FrameFlush(struct frame * frame)
+{
+	// Text printed before the frame must come first
+	fflush(stdout);
+
+	size_t written = 0;
+	while (written < frame->length)
+	{
+		ssize_t result = write(STDOUT_FILENO, frame->data + written, frame->length - written);
+		if (result <= 0)
+			break;
+		written += result;
+	}
 
-	printf("\e[0m");
+	frame->length = 0;
+	frame->bg = frame->fg = -1;
 }
 
-// Print board's complete row
-void PrintRow(int row)
+// Print squares that have changed since the board was printed and clear text below the board
+// Returns false if the whole board must be printed: for the first time, after terminal resize
+// or if the terminal is too small to keep the board in place while prompts are printed
+bool UpdateBoard(struct game * game, struct cell cells[MAXSIDE][MAXSIDE])
 {
-	// Print upper part of the row
-	for (int i = 0; i < (LEN - 1) / 2; i++)
+	struct frame * frame = &game->frame;
+	struct winsize size = {};
+	ioctl(STDOUT_FILENO, TIOCGWINSZ, &size);
+	int lines = game->side * LEN + 2;
+	bool resized = size.ws_row != frame->rows || size.ws_col != frame->columns;
+	frame->rows = size.ws_row;
+	frame->columns = size.ws_col;
+	if (!frame->drawn || resized || (size.ws_row > 0 && size.ws_row < lines + PROMPTLINES))
+		return false;
+
+	PrintChanges(game, cells);
+
+	// Leave the cursor under the board as full printing does
+	FrameText(frame, "\e[0m");
+	FrameMove(frame, lines + 1, 1);
+	FrameText(frame, "\e[J\e[s");
+	FrameFlush(frame);
+	return true;
+}
+
+// Print squares whose cells differ from the ones on the screen
+void PrintChanges(struct game * game, struct cell cells[MAXSIDE][MAXSIDE])
+{
+	struct frame * frame = &game->frame;
+	for (int i = 0; i < game->side; i++)
 	{
-		printf("\e[%dm   ", BORDER);
-		for (int j = 0; j < SIDE; j++)
+		for (int j = 0; j < game->side; j++)
 		{
-			if (board[row][j] == NULL)
-				PrintVacantSquare(WHITEBG);
-			else
+			if (game->board[i][j] == NULL)
+				continue;
+
+			if (memcmp(&cells[i][j], &frame->shadow[i][j], sizeof(struct cell)) != 0)
 			{
-				if (board[row][j]->bgselection == 1)
-					PrintVacantSquare(AVAILABLE);
-				else if (board[row][j]->bgselection > 1)
-					PrintVacantSquare(AMBIGUOUS);
-				else
-					PrintVacantSquare(BLACKBG);
+				frame->shadow[i][j] = cells[i][j];
+				PrintCell(game, i, j, cells[i][j]);
 			}
 		}
-
-		printf("\e[%dm   \e[0m\n", BORDER);
 	}
+}
 
-	// Print middle part with the pieces
-	printf("\e[%d;%dm %-2d", WHITEBG-10, BORDER, SIDE - row);
-	for (int i = 0; i < SIDE; i++)
-	{
-		if (board[row][i] == NULL)
-			PrintVacantSquare(WHITEBG);
-		else if (board[row][i]->type == nopiece)
-			{
-				if (board[row][i]->bgselection == 1)
-					PrintVacantSquare(AVAILABLE);
-				else if (board[row][i]->bgselection > 1)
-					PrintVacantSquare(AMBIGUOUS);
-				else
-					PrintVacantSquare(BLACKBG);
-			}
+// Return what is shown in the square
+struct cell SquareCell(struct square * square)
+{
+	struct cell cell = {};
+	cell.type = square->type;
+	cell.pcselected = square->type != nopiece && square->pcselected;
+	cell.bgselection = square->bgselection > 1 ? 2 : square->bgselection;
+	cell.cursor = square->cursor;
+	return cell;
+}
 
+// Print all lines of the square as it is shown in the cell in its place on the screen
+void PrintCell(struct game * game, int row, int col, struct cell cell)
+{
+	struct frame * frame = &game->frame;
+	struct square square = {.type = cell.type, .pcselected = cell.pcselected, .bgselection = cell.bgselection, .cursor = cell.cursor};
+	for (int i = 0; i < LEN; i++)
+	{
+		// Board starts after one line and three columns of the border
+		FrameMove(frame, 2 + row * LEN + i, 4 + col * LEN * 2);
+		if (i == (LEN - 1) / 2 && square.type != nopiece)
+			PrintSquare(frame, &square);
 		else
-		{
-			PrintSquare(board[row][i]);
-		}
+			PrintBackground(frame, &square);
 	}
-	printf("\e[%dm   \e[0m\n", BORDER);
+}
 
-	// Print lower part of the row
-	for (int i = 0; i < (LEN - 1) / 2; i++)
+// Write what is shown in every square of the board
+void SnapshotBoard(struct game * game, struct cell cells[MAXSIDE][MAXSIDE])
+{
+	for (int i = 0; i < game->side; i++)
 	{
-		printf("\e[%dm   ", BORDER);
-		for (int j = 0; j < SIDE; j++)
+		for (int j = 0; j < game->side; j++)
 		{
-			if (board[row][j] == NULL)
-				PrintVacantSquare(WHITEBG);
-			else
-			{
-				if (board[row][j]->bgselection == 1)
-					PrintVacantSquare(AVAILABLE);
-				else if (board[row][j]->bgselection > 1)
-					PrintVacantSquare(AMBIGUOUS);
-				else
-					PrintVacantSquare(BLACKBG);
-			}
+			if (game->board[i][j] != NULL)
+				cells[i][j] = SquareCell(game->board[i][j]);
 		}
+	}
+}
 
-		printf("\e[%dm   \e[0m\n", BORDER);
+// Add the step to the end of the animation
+struct step * AddStep(struct animation * animation)
+{
+	if (animation->count == animation->capacity)
+	{
+		animation->capacity = animation->capacity > 0 ? animation->capacity * 2 : 8;
+		animation->steps = realloc(animation->steps, sizeof(struct step) * animation->capacity);
 	}
+
+	return &animation->steps[animation->count++];
 }
 
-// Print board
-void PrintBoard()
+// Show the board as it is now for at least the given time without stopping the game
+void Animate(struct game * game, long hold)
 {
-	printf("\e[2J\e[H");
+	if (!game->animation.enabled)
+	{
+		PrintBoard(game);
+		return;
+	}
 
-	// prints upper border without letters
-	printf("\e[%dm   ", BORDER);
-	for (int i = 0; i < SIDE; i++)
+	struct step * step = AddStep(&game->animation);
+	step->hold = hold;
+	step->board = true;
+	SnapshotBoard(game, step->cells);
+	RunAnimation(game, false);
+}
+
+// Show the text below the board for at least the given time without stopping the game
+void Notify(struct game * game, const char * text, long hold)
+{
+	if (!game->animation.enabled)
 	{
-		for (int j = 0; j < 2 * LEN; j++)
-		{
-			printf(" ");
-		}
+		printf("%s", text);
+		return;
 	}
-	printf("   \e[0m\n");
 
-	for (int i = 0; i < SIDE; i++)
-		PrintRow(i);
+	struct step * step = AddStep(&game->animation);
+	step->hold = hold;
+	step->board = false;
+	snprintf(step->text, sizeof(step->text), "%s", text);
+	RunAnimation(game, false);
+}
 
-	// prints bottom border with letters
-	printf("\e[%d;%dm   ", WHITEBG-10, BORDER);
-	for (int i = 0; i < SIDE; i++)
+// Show steps of the animation whose time has come, if asked waits for all of them unless a key is pressed
+void RunAnimation(struct game * game, bool wait)
+{
+	struct animation * animation = &game->animation;
+	while (animation->next < animation->count || (wait && Now() < animation->due))
 	{
-		char c = 'A' + i;
-		for (int j = 0; j < 2 * LEN; j++)
+		double now = Now();
+		if (now < animation->due)
 		{
-			if (j == LEN - 1)
+			if (!wait)
+				return;
+
+			// Pressed key skips the rest of the animation and is left for reading
+			if (WaitInput((int)((animation->due - now) * 1000) + 1))
 			{
-				j++;
-				printf("%c%c", c, tolower(c));
+				animation->due = 0;
+				break;
 			}
-			else
-				printf(" ");
+			continue;
+		}
+
+		struct step * step = &animation->steps[animation->next++];
+		if (step->board && !UpdateBoard(game, step->cells))
+		{
+			// Board must be printed again, so it is shown as it is now
+			animation->count = animation->next = 0;
+			animation->due = 0;
+			PrintBoard(game);
+			return;
+		}
+		if (!step->board)
+		{
+			printf("%s", step->text);
+			fflush(stdout);
 		}
+		animation->due = now + step->hold / 1e6;
 	}
-	printf("   \e[0m\n\e[s");
 
-	/*int shift = SIDE * LEN * 2 + 7;
+	animation->count = animation->next = 0;
+}
+
+// Move the cursor to the given line and column (starting from 1)
+void FrameMove(struct frame * frame, int line, int column)
+{
+	char code[32];
+	int length = sprintf(code, "\e[%d;%dH", line, column);
+	memcpy(frame->data + frame->length, code, length);
+	frame->length += length;
+}
+
+// Print square without piece
+void PrintVacantSquare(struct frame * frame, int bg)
+{
+	FrameColor(frame, bg, 0);
+	for (int i = 0; i < LEN * 2; i++)
+		FrameText(frame, " ");
+}
+
+// Print square with piece
+void PrintSquare(struct frame * frame, struct square * piece)
+{
+	int square = piece->cursor ? CURSOR : BLACKBG;
+	FrameColor(frame, square, 0);
+	for (int i = 0; i < LEN - 1; i++)
+		FrameText(frame, " ");
+
+	int bg = piece->pcselected ? AVAILABLE : (piece->type % 2 == 0 ? BLACK : WHITE);
+	int fg = bg == WHITE ? BLACK-10 : WHITE-10;
+	char * fill = piece->type / 2 == 0 ? MAN : KING;
+	FrameColor(frame, bg, fg);
+	FrameText(frame, fill);
+
+	FrameColor(frame, square, 0);
+	for (int i = 0; i < LEN - 1; i++)
+		FrameText(frame, " ");
+}
+
+// Print background of the square in the row of the board
+void PrintBackground(struct frame * frame, struct square * square)
+{
+	if (square == NULL)
+		PrintVacantSquare(frame, WHITEBG);
+	else if (square->cursor)
+		PrintVacantSquare(frame, CURSOR);
+	else if (square->bgselection == 1)
+		PrintVacantSquare(frame, AVAILABLE);
+	else if (square->bgselection > 1)
+		PrintVacantSquare(frame, AMBIGUOUS);
+	else
+		PrintVacantSquare(frame, BLACKBG);
+}
+
+// Print board's complete row
+void PrintRow(struct game * game, int row)
+{
+	struct frame * frame = &game->frame;
+
+	// Print upper part of the row
+	for (int i = 0; i < (LEN - 1) / 2; i++)
+	{
+		FrameColor(frame, BORDER, 0);
+		FrameText(frame, "   ");
+		for (int j = 0; j < game->side; j++)
+			PrintBackground(frame, game->board[row][j]);
+
+		FrameColor(frame, BORDER, 0);
+		FrameText(frame, "   ");
+		FrameLine(frame);
+	}
+
+	// Print middle part with the pieces
+	char label[8];
+	sprintf(label, " %-2d", game->side - row);
+	FrameColor(frame, BORDER, WHITEBG-10);
+	FrameText(frame, label);
+	for (int i = 0; i < game->side; i++)
+	{
+		if (game->board[row][i] == NULL || game->board[row][i]->type == nopiece)
+			PrintBackground(frame, game->board[row][i]);
+		else
+			PrintSquare(frame, game->board[row][i]);
+	}
+	FrameColor(frame, BORDER, 0);
+	FrameText(frame, "   ");
+	FrameLine(frame);
+
+	// Print lower part of the row
+	for (int i = 0; i < (LEN - 1) / 2; i++)
+	{
+		FrameColor(frame, BORDER, 0);
+		FrameText(frame, "   ");
+		for (int j = 0; j < game->side; j++)
+			PrintBackground(frame, game->board[row][j]);
+
+		FrameColor(frame, BORDER, 0);
+		FrameText(frame, "   ");
+		FrameLine(frame);
+	}
+}
+
+// Print board
+void PrintBoard(struct game * game)
+{
+	if (game->headless)
+		return;
+	// Steps of the animation are shown before the board as it is now
+	RunAnimation(game, true);
+
+	// Print only changed squares if possible
+	struct frame * frame = &game->frame;
+	struct cell cells[MAXSIDE][MAXSIDE];
+	SnapshotBoard(game, cells);
+	if (UpdateBoard(game, cells))
+		return;
+
+	FrameText(frame, "\e[2J\e[H");
+	memcpy(frame->shadow, cells, sizeof(cells));
+	frame->drawn = true;
+
+	// prints upper border without letters
+	FrameColor(frame, BORDER, 0);
+	FrameText(frame, "   ");
+	for (int i = 0; i < game->side; i++)
+	{
+		for (int j = 0; j < 2 * LEN; j++)
+			FrameText(frame, " ");
+	}
+	FrameText(frame, "   ");
+	FrameLine(frame);
+
+	for (int i = 0; i < game->side; i++)
+		PrintRow(game, i);
+
+	// prints bottom border with letters
+	FrameColor(frame, BORDER, WHITEBG-10);
+	FrameText(frame, "   ");
+	for (int i = 0; i < game->side; i++)
+	{
+		char letters[3] = {'A' + i, 'a' + i, '\0'};
+		for (int j = 0; j < 2 * LEN; j++)
+		{
+			if (j == LEN - 1)
+			{
+				j++;
+				FrameText(frame, letters);
+			}
+			else
+				FrameText(frame, " ");
+		}
+	}
+	FrameText(frame, "   ");
+	FrameLine(frame);
+	FrameText(frame, "\e[s");
+
+	FrameFlush(frame);
+
+	/*int shift = game->side * LEN * 2 + 7;
 	printf("\n\e[1;%dH", shift);
 
-	printf("\tWhite pieces: %d", pieces[1]);
+	printf("\tWhite pieces: %d", game->pieces[1]);
 	printf("\n\e[2;%dH", shift);
-	printf("\tBlack pieces: %d", pieces[0]);
+	printf("\tBlack pieces: %d", game->pieces[0]);
 	printf("\e[u");*/
-}
\ No newline at end of file
+}
+
+// Compute packing of board's dark squares into bits
+void InitializeLayout(struct layout * layout, int side)
+{
+	memset(layout, 0, sizeof(struct layout));
+	layout->side = side;
+	layout->width = side % 2 == 0 ? side + 1 : side;
+	layout->bits = ((side - 1) * layout->width + side - 1) / 2 + 1;
+	layout->words = (layout->bits + 63) / 64;
+
+	// Diagonal steps in the same order as square's "adjacent" array
+	layout->shift[0] = -(layout->width + 1) / 2;
+	layout->shift[1] = -(layout->width - 1) / 2;
+	layout->shift[2] = (layout->width + 1) / 2;
+	layout->shift[3] = (layout->width - 1) / 2;
+	int drow[4] = {-1, -1, 1, 1};
+	int dcol[4] = {-1, 1, 1, -1};
+
+	for (int i = 0; i < MAXSIDE; i++)
+	{
+		for (int j = 0; j < MAXSIDE; j++)
+			layout->index[i][j] = -1;
+	}
+	for (int i = 0; i < MAXBITS; i++)
+	{
+		layout->row[i] = layout->col[i] = -1;
+		for (int d = 0; d < 4; d++)
+			layout->adjacent[i][d] = -1;
+	}
+
+	// Number dark squares
+	for (int i = 0; i < side; i++)
+	{
+		for (int j = 0; j < side; j++)
+		{
+			if ((i + j) % 2 == 0)
+				continue;
+
+			int bit = (i * layout->width + j) / 2;
+			layout->index[i][j] = bit;
+			layout->row[bit] = i;
+			layout->col[bit] = j;
+			BitSet(&layout->squares, bit);
+			if (i == side - 1)
+				BitSet(&layout->lastrow[0], bit);
+			if (i == 0)
+				BitSet(&layout->lastrow[1], bit);
+
+			// Bonus of a man for its square is split into bits, so that it is counted by popcounts
+			for (int color = 0; color < 2; color++)
+			{
+				int advance = color == 0 ? i : side - 1 - i;
+				int bonus = ADVANCEVALUE * advance + (advance == 0 ? GUARDVALUE : 0);
+				for (int k = 0; k < EVALPLANES; k++)
+				{
+					if ((bonus >> k) & 1)
+						BitSet(&layout->bonus[color][k], bit);
+				}
+			}
+		}
+	}
+
+	// Link adjacent squares
+	for (int i = 0; i < side; i++)
+	{
+		for (int j = 0; j < side; j++)
+		{
+			int bit = layout->index[i][j];
+			if (bit == -1)
+				continue;
+
+			for (int d = 0; d < 4; d++)
+			{
+				int row = i + drow[d], col = j + dcol[d];
+				if (row < 0 || row >= side || col < 0 || col >= side)
+					continue;
+
+				layout->adjacent[bit][d] = layout->index[row][col];
+				BitSet(&layout->source[d], bit);
+			}
+		}
+	}
+
+	// Collect diagonals
+	for (int i = 0; i < layout->bits; i++)
+	{
+		if (layout->row[i] == -1)
+			continue;
+
+		BitSet(&layout->lines[i], i);
+		for (int d = 0; d < 4; d++)
+		{
+			for (int j = layout->adjacent[i][d]; j != -1; j = layout->adjacent[j][d])
+				BitSet(&layout->lines[i], j);
+		}
+	}
+}
+
+// Return squares that are occupied by any piece
+struct bitboard Occupied(const struct position * position)
+{
+	return BitOr(BitOr(position->men[0], position->men[1]), BitOr(position->kings[0], position->kings[1]));
+}
+
+// Return bitboard that stores pieces of the given type
+struct bitboard * PieceMask(struct position * position, enum piece type)
+{
+	return type / 2 == 0 ? &position->men[type % 2] : &position->kings[type % 2];
+}
+
+// Return squares reached from the start squares by going through empty squares in the given direction
+// (including the first occupied square on the way)
+struct bitboard Ray(const struct layout * layout, struct bitboard start, struct bitboard empty, int direction)
+{
+	struct bitboard reach = {};
+	struct bitboard ray = BitStep(layout, start, direction);
+	while (BitAny(ray))
+	{
+		reach = BitOr(reach, ray);
+		ray = BitStep(layout, BitAnd(ray, empty), direction);
+	}
+
+	return reach;
+}
+
+// Return those of the given men that are able to capture
+struct bitboard ManCapturers(const struct layout * layout, const struct position * position, int color, struct bitboard men)
+{
+	int enemy = (color + 1) % 2;
+	struct bitboard enemies = BitOr(position->men[enemy], position->kings[enemy]);
+	struct bitboard empty = BitAndNot(layout->squares, Occupied(position));
+	struct bitboard result = {};
+	for (int i = 0; i < 4; i++)
+	{
+		// Jump over an adjacent enemy to the empty square behind it and go back to the man
+		struct bitboard land = BitAnd(BitStep(layout, BitAnd(BitStep(layout, men, i), enemies), i), empty);
+		result = BitOr(result, BitStep(layout, BitStep(layout, land, Opposite(i)), Opposite(i)));
+	}
+
+	return result;
+}
+
+// Return those of the given kings that are able to capture
+struct bitboard KingCapturers(const struct layout * layout, const struct position * position, int color, struct bitboard kings)
+{
+	int enemy = (color + 1) % 2;
+	struct bitboard enemies = BitOr(position->men[enemy], position->kings[enemy]);
+	struct bitboard empty = BitAndNot(layout->squares, Occupied(position));
+	struct bitboard result = {};
+	for (int i = 0; i < 4; i++)
+	{
+		// Find enemies at the end of empty diagonals that have an empty square behind them
+		struct bitboard targets = BitAnd(Ray(layout, kings, empty, i), enemies);
+		struct bitboard land = BitAnd(BitStep(layout, targets, i), empty);
+		targets = BitStep(layout, land, Opposite(i));
+		// Go back along the diagonals to the kings
+		result = BitOr(result, BitAnd(Ray(layout, targets, empty, Opposite(i)), kings));
+	}
+
+	return result;
+}
+
+// Return those of the given pieces that are able to move to an adjacent square
+struct bitboard Movers(const struct layout * layout, const struct position * position, int color, struct bitboard pieces)
+{
+	struct bitboard empty = BitAndNot(layout->squares, Occupied(position));
+	struct bitboard men = BitAnd(pieces, position->men[color]);
+	struct bitboard kings = BitAnd(pieces, position->kings[color]);
+	struct bitboard result = {};
+	for (int i = 0; i < 4; i++)
+	{
+		// Men go only forward, kings go in all directions
+		struct bitboard movers = (i / 2 == color) ? kings : BitOr(men, kings);
+		result = BitOr(result, BitStep(layout, BitAnd(BitStep(layout, movers, i), empty), Opposite(i)));
+	}
+
+	return result;
+}
+
+// Put the piece of given type to the square and keep bitboards in sync
+void PlacePiece(struct game * game, struct square * square, enum piece type)
+{
+	if (square->type != nopiece)
+	{
+		BitClear(PieceMask(&game->position, square->type), square->index);
+		game->position.hash ^= PieceKey(square->type, square->index);
+	}
+	square->type = type;
+	if (type != nopiece)
+	{
+		BitSet(PieceMask(&game->position, type), square->index);
+		game->position.hash ^= PieceKey(type, square->index);
+	}
+	UpdateMobility(game, square->index);
+}
+
+// Recompute which pieces are able to capture or move among those that can be affected by the change of the square
+// Any piece whose moves depend on the square stands on one of its diagonals
+void UpdateMobility(struct game * game, int index)
+{
+	struct bitboard lines = game->layout.lines[index];
+	for (int color = 0; color < 2; color++)
+	{
+		struct bitboard men = BitAnd(game->position.men[color], lines);
+		struct bitboard kings = BitAnd(game->position.kings[color], lines);
+		struct bitboard capturers = BitOr(ManCapturers(&game->layout, &game->position, color, men),
+			KingCapturers(&game->layout, &game->position, color, kings));
+		game->capturers[color] = BitOr(BitAndNot(game->capturers[color], lines), capturers);
+		struct bitboard movers = Movers(&game->layout, &game->position, color, BitOr(men, kings));
+		game->movers[color] = BitOr(BitAndNot(game->movers[color], lines), movers);
+	}
+}
+
+// Return board's square by its bit
+struct square * SquareAt(struct game * game, int index)
+{
+	return game->board[game->layout.row[index]][game->layout.col[index]];
+}
+
+// Fill the list with all legal moves of the side to move and return their number
+// (if it is bigger than capacity, only first moves are stored); captures are mandatory as in MustCapture()
+int GenerateMoves(const struct layout * layout, const struct position * position, struct flatmove * list, int capacity)
+{
+	int color = position->color;
+	int enemy = (color + 1) % 2;
+	struct jumpscan scan = {};
+	scan.layout = layout;
+	scan.empty = BitAndNot(layout->squares, Occupied(position));
+	scan.enemies = BitOr(position->men[enemy], position->kings[enemy]);
+	scan.color = color;
+	scan.list = list;
+	scan.capacity = capacity;
+
+	// Capture sequences
+	struct bitboard men = ManCapturers(layout, position, color, position->men[color]);
+	struct bitboard kings = KingCapturers(layout, position, color, position->kings[color]);
+	if (BitAny(men) || BitAny(kings))
+	{
+		for (int from = BitPop(&men); from != -1; from = BitPop(&men))
+		{
+			// The square that piece leaves can be crossed
+			scan.move.from = from;
+			BitSet(&scan.empty, from);
+			ManJumps(&scan, from);
+			BitClear(&scan.empty, from);
+		}
+		for (int from = BitPop(&kings); from != -1; from = BitPop(&kings))
+		{
+			scan.move.from = from;
+			BitSet(&scan.empty, from);
+			KingJumps(&scan, from);
+			BitClear(&scan.empty, from);
+		}
+
+		return scan.count;
+	}
+
+	// Moves of men to adjacent squares
+	for (int i = 0; i < 4; i++)
+	{
+		if (i / 2 == color)
+			continue;
+
+		struct bitboard targets = BitAnd(BitStep(layout, position->men[color], i), scan.empty);
+		for (int to = BitPop(&targets); to != -1; to = BitPop(&targets))
+		{
+			scan.move.from = to - layout->shift[i];
+			scan.move.to = to;
+			scan.move.promotion = BitTest(layout->lastrow[color], to);
+			AddMove(&scan);
+		}
+	}
+
+	// Moves of kings along diagonals
+	scan.move.promotion = false;
+	kings = position->kings[color];
+	for (int from = BitPop(&kings); from != -1; from = BitPop(&kings))
+	{
+		scan.move.from = from;
+		for (int i = 0; i < 4; i++)
+		{
+			for (int to = layout->adjacent[from][i]; to != -1 && BitTest(scan.empty, to); to = layout->adjacent[to][i])
+			{
+				scan.move.to = to;
+				AddMove(&scan);
+			}
+		}
+	}
+
+	return scan.count;
+}
+
+// Store the move that is being built into the list
+void AddMove(struct jumpscan * scan)
+{
+	if (scan->count < scan->capacity)
+		scan->list[scan->count] = scan->move;
+	scan->count++;
+}
+
+// Continue capture sequence of a man from the given square and store every complete (maximal) sequence
+// The rule is the one of ManCaptureScan(): jumped pieces stay on the board until the move is over
+// and only the same jump cannot be made twice (in either direction)
+void ManJumps(struct jumpscan * scan, int square)
+{
+	const struct layout * layout = scan->layout;
+	struct flatmove * move = &scan->move;
+	bool found = false;
+	for (int i = 0; i < 4; i++)
+	{
+		int over = layout->adjacent[square][i];
+		if (over == -1 || !BitTest(scan->enemies, over) || BitTest(scan->crossed[i], square))
+			continue;
+		int land = layout->adjacent[over][i];
+		if (land == -1 || !BitTest(scan->empty, land))
+			continue;
+
+		found = true;
+		if (move->length < MAXPATH)
+			move->path[move->length] = land;
+		move->length++;
+		// Piece can be jumped again along its other diagonal, so it may be in captured already
+		struct bitboard captured = move->captured;
+		BitSet(&move->captured, over);
+		BitSet(&scan->crossed[i], square);
+		BitSet(&scan->crossed[Opposite(i)], land);
+		ManJumps(scan, land);
+		BitClear(&scan->crossed[Opposite(i)], land);
+		BitClear(&scan->crossed[i], square);
+		move->captured = captured;
+		move->length--;
+	}
+
+	// Man becomes a king only if the sequence ends on the last row
+	if (!found)
+	{
+		move->to = square;
+		move->promotion = BitTest(layout->lastrow[scan->color], square);
+		AddMove(scan);
+		move->promotion = false;
+	}
+}
+
+// Continue capture sequence of a king from the given square and store every complete (maximal) sequence
+// The rule is the one of MoveKing(): a captured piece is taken off the board at once, so the king can go through its square
+void KingJumps(struct jumpscan * scan, int square)
+{
+	const struct layout * layout = scan->layout;
+	struct flatmove * move = &scan->move;
+	bool found = false;
+	for (int i = 0; i < 4; i++)
+	{
+		// Find the first piece on the diagonal
+		int over = layout->adjacent[square][i];
+		while (over != -1 && BitTest(scan->empty, over))
+			over = layout->adjacent[over][i];
+		if (over == -1 || !BitTest(scan->enemies, over))
+			continue;
+
+		// Land on every empty square behind it
+		BitSet(&scan->empty, over);
+		for (int land = layout->adjacent[over][i]; land != -1 && BitTest(scan->empty, land); land = layout->adjacent[land][i])
+		{
+			found = true;
+			if (move->length < MAXPATH)
+				move->path[move->length] = land;
+			move->length++;
+			BitSet(&move->captured, over);
+			KingJumps(scan, land);
+			BitClear(&move->captured, over);
+			move->length--;
+		}
+		BitClear(&scan->empty, over);
+	}
+
+	if (!found)
+	{
+		move->to = square;
+		AddMove(scan);
+	}
+}
+
+// Apply the move to the position and pass the turn
+void MakeMove(struct position * position, const struct flatmove * move)
+{
+	int color = position->color;
+	int enemy = (color + 1) % 2;
+	enum piece type = BitTest(position->kings[color], move->from) ? bking + color : bman + color;
+	enum piece result = move->promotion ? bking + color : type;
+
+	BitClear(PieceMask(position, type), move->from);
+	BitSet(PieceMask(position, result), move->to);
+	position->hash ^= PieceKey(type, move->from) ^ PieceKey(result, move->to);
+
+	// Remove captured pieces
+	if (move->length > 0)
+	{
+		struct bitboard men = BitAnd(position->men[enemy], move->captured);
+		struct bitboard kings = BitAnd(position->kings[enemy], move->captured);
+		for (int bit = BitPop(&men); bit != -1; bit = BitPop(&men))
+			position->hash ^= PieceKey(bman + enemy, bit);
+		for (int bit = BitPop(&kings); bit != -1; bit = BitPop(&kings))
+			position->hash ^= PieceKey(bking + enemy, bit);
+		position->men[enemy] = BitAndNot(position->men[enemy], move->captured);
+		position->kings[enemy] = BitAndNot(position->kings[enemy], move->captured);
+	}
+
+	position->color = enemy;
+	position->hash ^= ColorKey();
+}
+
+// Set the side to move keeping the hash in sync
+void SetColor(struct position * position, int color)
+{
+	if (position->color != color)
+		position->hash ^= ColorKey();
+	position->color = color;
+}
+
+// Compute the hash of the position from scratch
+uint64_t HashPosition(const struct layout * layout, const struct position * position)
+{
+	uint64_t hash = SideKey(layout->side) ^ (position->color == 1 ? ColorKey() : 0);
+	for (int type = bman; type <= wking; type++)
+	{
+		struct bitboard pieces = type / 2 == 0 ? position->men[type % 2] : position->kings[type % 2];
+		for (int bit = BitPop(&pieces); bit != -1; bit = BitPop(&pieces))
+			hash ^= PieceKey(type, bit);
+	}
+
+	return hash;
+}
+
+// Count leaf nodes of the move tree of given depth; stack must have room for depth * MAXMOVES moves
+uint64_t Perft(const struct layout * layout, const struct position * position, int depth, struct flatmove * stack)
+{
+	if (depth == 0)
+		return 1;
+
+	int count = GenerateMoves(layout, position, stack, MAXMOVES);
+	if (depth == 1)
+		return count;
+	if (count > MAXMOVES)
+	{
+		fprintf(stderr, "Position has more than %d moves\n", MAXMOVES);
+		exit(1);
+	}
+
+	uint64_t nodes = 0;
+	for (int i = 0; i < count; i++)
+	{
+		struct position next = *position;
+		MakeMove(&next, &stack[i]);
+		nodes += Perft(layout, &next, depth - 1, stack + MAXMOVES);
+	}
+
+	return nodes;
+}
+
+// Run "perft DEPTH [SIDE | FILE] [--threads N] [--scaling] [--verify]": count move tree nodes from the initial or saved position
+int PerftCommand(int argc, char * argv[])
+{
+	// Parse arguments
+	int depth = 0, threads = 1;
+	bool scaling = false, verify = false;
+	char * source = "8";
+	for (int i = 0; i < argc; i++)
+	{
+		if (strcmp(argv[i], "--threads") == 0 && i + 1 < argc)
+			threads = atoi(argv[++i]);
+		else if (strcmp(argv[i], "--scaling") == 0)
+			scaling = true;
+		else if (strcmp(argv[i], "--verify") == 0)
+			verify = true;
+		else if (depth == 0)
+			depth = atoi(argv[i]);
+		else
+			source = argv[i];
+	}
+	if (depth < 1 || threads < 1)
+	{
+		fprintf(stderr, "Usage: checkers perft DEPTH [SIDE | FILE] [--threads N] [--scaling] [--verify]\n");
+		return 1;
+	}
+
+	struct game * game = SetupGame(source);
+	if (game == NULL)
+		return 1;
+
+	struct flatmove * stack = malloc(sizeof(struct flatmove) * MAXMOVES * depth);
+	uint64_t * divide = calloc(MAXMOVES, sizeof(uint64_t));
+	const struct layout * layout = &game->layout;
+	const struct position * position = &game->position;
+
+	// Compare moves of the board's scanning functions with generated ones in every position of the tree
+	if (verify)
+	{
+		struct position root = game->position;
+		struct flatmove * legacy = malloc(sizeof(struct flatmove) * MAXMOVES);
+		uint64_t checked = 0;
+		bool same = VerifyPerft(game, &root, depth, stack, legacy, &checked);
+		if (same)
+			printf("depth %d: moves of %llu positions are the same\n", depth, (unsigned long long)checked);
+		free(legacy);
+		free(divide);
+		free(stack);
+		ClearBoard(game);
+		free(game);
+		return same ? 0 : 1;
+	}
+
+	// Totals for every smaller depth
+	for (int d = 1; d < depth; d++)
+	{
+		double start = Now();
+		uint64_t nodes = ParallelPerft(layout, position, d, threads, divide);
+		double time = Now() - start;
+		printf("depth %d: %llu nodes, %.3f s, %.0f nodes/s\n", d, (unsigned long long)nodes, time, time > 0 ? nodes / time : 0);
+	}
+
+	// Divide the last depth by root moves
+	double start = Now();
+	uint64_t nodes = ParallelPerft(layout, position, depth, threads, divide);
+	double time = Now() - start;
+	int count = GenerateMoves(layout, position, stack, MAXMOVES);
+	for (int i = 0; i < count; i++)
+	{
+		char name[8 * (MAXPATH + 2)];
+		MoveName(layout, &stack[i], name);
+		printf("%s %llu\n", name, (unsigned long long)divide[i]);
+	}
+	printf("depth %d: %llu nodes, %.3f s, %.0f nodes/s\n", depth, (unsigned long long)nodes, time, time > 0 ? nodes / time : 0);
+
+	// Repeat the last depth with 1, 2, 4... threads
+	if (scaling)
+	{
+		double base = 0;
+		for (int n = 1; ; n = n * 2 < threads ? n * 2 : threads)
+		{
+			double start = Now();
+			uint64_t check = ParallelPerft(layout, position, depth, n, divide);
+			double time = Now() - start;
+			if (n == 1)
+				base = time;
+			printf("threads %d: %.3f s, %.0f nodes/s, speedup %.2f%s\n", n, time, time > 0 ? check / time : 0,
+				time > 0 ? base / time : 0, check == nodes ? "" : " (NODE COUNT MISMATCH)");
+			if (n == threads)
+				break;
+		}
+	}
+
+	free(divide);
+	free(stack);
+	ClearBoard(game);
+	free(game);
+	return 0;
+}
+
+// Check every position of the tree of given depth: moves that the player is able to make on the board must be the generated ones
+// Prints the first position where they differ; legacy must have room for MAXMOVES moves
+bool VerifyPerft(struct game * game, const struct position * position, int depth, struct flatmove * stack, struct flatmove * legacy, uint64_t * checked)
+{
+	if (depth == 0)
+		return true;
+
+	const struct layout * layout = &game->layout;
+	int count = GenerateMoves(layout, position, stack, MAXMOVES);
+	int found = LegacyMoves(game, position, legacy);
+	if (count > MAXMOVES || found > MAXMOVES)
+	{
+		fprintf(stderr, "Position has more than %d moves\n", MAXMOVES);
+		exit(1);
+	}
+	(*checked)++;
+
+	// Moves that are missing from the other list
+	if (MissingMove(legacy, found, stack, count) != -1 || MissingMove(stack, count, legacy, found) != -1)
+	{
+		char fen[MAXBITS * 6];
+		char name[8 * (MAXPATH + 2)];
+		WriteFen(layout, position, fen);
+		printf("Moves differ in position %llu: %s\nboard only:", (unsigned long long)*checked, fen);
+		for (int i = 0; i < found; i++)
+		{
+			if (MissingMove(legacy + i, 1, stack, count) != -1)
+			{
+				MoveName(layout, &legacy[i], name);
+				printf(" %s", name);
+			}
+		}
+		printf("\ngenerated only:");
+		for (int i = 0; i < count; i++)
+		{
+			if (MissingMove(stack + i, 1, legacy, found) != -1)
+			{
+				MoveName(layout, &stack[i], name);
+				printf(" %s", name);
+			}
+		}
+		printf("\n");
+		return false;
+	}
+
+	for (int i = 0; i < count; i++)
+	{
+		struct position next = *position;
+		MakeMove(&next, &stack[i]);
+		if (!VerifyPerft(game, &next, depth - 1, stack + MAXMOVES, legacy, checked))
+			return false;
+	}
+
+	return true;
+}
+
+// Fill the list with moves of the side to move that the player is able to make on the board (the way Move() finds them)
+// and return their number; list must have room for MAXMOVES moves
+int LegacyMoves(struct game * game, const struct position * position, struct flatmove * list)
+{
+	for (int i = 0; i < game->layout.bits; i++)
+	{
+		if (game->layout.row[i] != -1)
+			PlacePiece(game, SquareAt(game, i), PositionPiece(position, i));
+	}
+	SetColor(&game->position, position->color);
+
+	int color = position->color;
+	int enemy = (color + 1) % 2;
+	int count = 0;
+	bool mustcapture = MustCapture(game, color);
+	struct bitboard pieces = mustcapture ? game->capturers[color] : game->movers[color];
+	for (int from = BitPop(&pieces); from != -1; from = BitPop(&pieces))
+	{
+		struct square * piece = SquareAt(game, from);
+		struct flatmove move = {};
+		move.from = from;
+		game->movestart = Allocate(&game->arena, sizeof(struct move));
+		if (mustcapture && piece->type / 2 == 0)
+		{
+			piece->pcselected = true;
+			ManCaptureScan(&game->arena, piece, game->movestart, enemy, ALLDIRECT);
+			piece->pcselected = false;
+			count = ListManCaptures(game->movestart, ALLDIRECT, &move, list, count);
+			ClearMoveList(game->movestart, ALLDIRECT);
+		}
+		else if (mustcapture)
+			count = ListKingCaptures(game, piece, &move, list, count);
+		else if (piece->type / 2 == 0)
+		{
+			// Men go only forward as in MoveMan()
+			int direction = piece->type % 2 == 0 ? 1 : -1;
+			for (int i = direction + 1; i < direction + 3; i++)
+			{
+				if (piece->adjacent[i] != NULL && piece->adjacent[i]->type == nopiece && count < MAXMOVES)
+				{
+					move.to = piece->adjacent[i]->index;
+					list[count++] = move;
+				}
+			}
+		}
+		else
+		{
+			KingMoveScan(game, piece);
+			for (int i = 0; i < 4; i++)
+			{
+				for (struct move * next = game->movestart->next[i]; next != NULL && count < MAXMOVES; next = next->next[i])
+				{
+					move.to = next->square->index;
+					list[count++] = move;
+				}
+			}
+		}
+		ResetArena(&game->arena);
+	}
+
+	return count;
+}
+
+// Add every sequence of the man's capture tree after the entry to the list, move holds the sequence up to the entry
+int ListManCaptures(struct move * entry, int prohibited, const struct flatmove * move, struct flatmove * list, int count)
+{
+	bool found = false;
+	for (int i = 0; i < 4; i++)
+	{
+		if (i == prohibited || entry->next[i] == NULL)
+			continue;
+
+		found = true;
+		struct flatmove next = *move;
+		BitSet(&next.captured, entry->tocapture[i]->index);
+		if (next.length < MAXPATH)
+			next.path[next.length] = entry->next[i]->square->index;
+		next.length++;
+		count = ListManCaptures(entry->next[i], Opposite(i), &next, list, count);
+	}
+
+	if (!found && count < MAXMOVES)
+	{
+		list[count] = *move;
+		list[count++].to = entry->square->index;
+	}
+	return count;
+}
+
+// Add every capture sequence of the king to the list the way the player makes it: one captured piece after another
+// with the scans of MoveKing(), move holds the sequence up to the king's square
+int ListKingCaptures(struct game * game, struct square * piece, const struct flatmove * move, struct flatmove * list, int count)
+{
+	struct move * start = Allocate(&game->arena, sizeof(struct move));
+	game->movestart = start;
+	if (!KingSimpleCaptureScan(game, piece) || KingCaptureScan(game, piece) == 0)
+	{
+		if (count < MAXMOVES)
+		{
+			list[count] = *move;
+			list[count++].to = piece->index;
+		}
+		return count;
+	}
+
+	enum piece type = piece->type;
+	for (int i = 0; i < 4; i++)
+	{
+		for (struct move * land = start->next[i]; land != NULL; land = land->next[i])
+		{
+			int over = start->tocapture[i]->index;
+			struct flatmove next = *move;
+			BitSet(&next.captured, over);
+			if (next.length < MAXPATH)
+				next.path[next.length] = land->square->index;
+			next.length++;
+
+			// Go to the landing square and take the captured piece off the board as KingCapture() does
+			enum piece victim = start->tocapture[i]->type;
+			PlacePiece(game, piece, nopiece);
+			PlacePiece(game, start->tocapture[i], nopiece);
+			PlacePiece(game, land->square, type);
+			count = ListKingCaptures(game, land->square, &next, list, count);
+			PlacePiece(game, land->square, nopiece);
+			PlacePiece(game, start->tocapture[i], victim);
+			PlacePiece(game, piece, type);
+		}
+	}
+
+	return count;
+}
+
+// Return the index of the first move of the list that has no move with the same squares and captured pieces among others (-1 if there is none)
+int MissingMove(const struct flatmove * list, int count, const struct flatmove * others, int total)
+{
+	for (int i = 0; i < count; i++)
+	{
+		bool found = false;
+		for (int j = 0; j < total && !found; j++)
+		{
+			found = list[i].from == others[j].from && list[i].to == others[j].to
+				&& memcmp(&list[i].captured, &others[j].captured, sizeof(struct bitboard)) == 0;
+		}
+		if (!found)
+			return i;
+	}
+
+	return -1;
+}
+
+// Create the game from the initial position of the given board size or from the save file (NULL on failure)
+struct game * SetupGame(char * source)
+{
+	struct game * game = calloc(1, sizeof(struct game));
+	bool fromfile = !isdigit(source[0]);
+	game->side = fromfile ? SavedSide(source) : atoi(source);
+	if (fromfile && game->side == 0)
+	{
+		fprintf(stderr, "Couldn't open savefile %s\n", source);
+		free(game);
+		return NULL;
+	}
+	if (CheckSide(game->side))
+	{
+		free(game);
+		return NULL;
+	}
+
+	InitializeBoard(game);
+	if (fromfile && LoadFile(game, source) != 0)
+	{
+		fprintf(stderr, "Savefile %s is damaged\n", source);
+		ClearBoard(game);
+		free(game);
+		return NULL;
+	}
+	if (!fromfile)
+		InitializePieces(game);
+	return game;
+}
+
+// Count nodes of the tree of given depth with several threads and store subtotals of every root move into divide
+// The tree is split into subtrees that are shared between threads, an idle thread takes subtrees of others
+uint64_t ParallelPerft(const struct layout * layout, const struct position * position, int depth, int threads, uint64_t * divide)
+{
+	int count = 0;
+	struct perfttask * tasks = SplitPerft(layout, position, depth, threads * 64, &count);
+
+	// Give every thread its share of subtrees
+	struct perftworker * workers = calloc(threads, sizeof(struct perftworker));
+	for (int i = 0; i < threads; i++)
+	{
+		workers[i].id = i;
+		workers[i].count = threads;
+		workers[i].workers = workers;
+		workers[i].layout = layout;
+		workers[i].tasks = tasks;
+		workers[i].depth = depth;
+		workers[i].end = (int)((long)count * (i + 1) / threads);
+		atomic_init(&workers[i].next, (int)((long)count * i / threads));
+	}
+	for (int i = 1; i < threads; i++)
+		pthread_create(&workers[i].thread, NULL, PerftWorker, &workers[i]);
+	PerftWorker(&workers[0]);
+	for (int i = 1; i < threads; i++)
+		pthread_join(workers[i].thread, NULL);
+
+	// Sum subtrees
+	uint64_t nodes = 0;
+	memset(divide, 0, sizeof(uint64_t) * MAXMOVES);
+	for (int i = 0; i < count; i++)
+	{
+		divide[tasks[i].root] += tasks[i].nodes;
+		nodes += tasks[i].nodes;
+	}
+
+	free(workers);
+	free(tasks);
+	return nodes;
+}
+
+// Split the tree into at least the given number of subtrees (if the tree is big enough)
+struct perfttask * SplitPerft(const struct layout * layout, const struct position * position, int depth, int target, int * count)
+{
+	struct flatmove * list = malloc(sizeof(struct flatmove) * MAXMOVES);
+
+	// Root moves
+	int roots = GenerateMoves(layout, position, list, MAXMOVES);
+	if (roots > MAXMOVES)
+	{
+		fprintf(stderr, "Position has more than %d moves\n", MAXMOVES);
+		exit(1);
+	}
+	struct perfttask * tasks = malloc(sizeof(struct perfttask) * (roots > 0 ? roots : 1));
+	for (int i = 0; i < roots; i++)
+	{
+		tasks[i].position = *position;
+		MakeMove(&tasks[i].position, &list[i]);
+		tasks[i].depth = depth - 1;
+		tasks[i].root = i;
+		tasks[i].nodes = 0;
+	}
+	*count = roots;
+
+	// Expand every subtree by one level until there are enough of them
+	while (*count > 0 && *count < target && tasks[0].depth > 1)
+	{
+		int size = 0, capacity = *count * 8;
+		struct perfttask * next = malloc(sizeof(struct perfttask) * capacity);
+		for (int i = 0; i < *count; i++)
+		{
+			int moves = GenerateMoves(layout, &tasks[i].position, list, MAXMOVES);
+			if (moves > MAXMOVES)
+			{
+				fprintf(stderr, "Position has more than %d moves\n", MAXMOVES);
+				exit(1);
+			}
+			if (size + moves > capacity)
+			{
+				capacity = (size + moves) * 2;
+				next = realloc(next, sizeof(struct perfttask) * capacity);
+			}
+			for (int j = 0; j < moves; j++)
+			{
+				next[size] = tasks[i];
+				MakeMove(&next[size].position, &list[j]);
+				next[size].depth--;
+				size++;
+			}
+		}
+		free(tasks);
+		tasks = next;
+		*count = size;
+	}
+
+	free(list);
+	return tasks;
+}
+
+// Count nodes of own subtrees, then help other threads with theirs
+void * PerftWorker(void * arg)
+{
+	struct perftworker * worker = arg;
+	struct flatmove * stack = malloc(sizeof(struct flatmove) * MAXMOVES * (worker->depth > 0 ? worker->depth : 1));
+	for (int i = 0; i < worker->count; i++)
+	{
+		struct perftworker * victim = &worker->workers[(worker->id + i) % worker->count];
+		int task;
+		while ((task = atomic_fetch_add(&victim->next, 1)) < victim->end)
+		{
+			struct perfttask * current = &worker->tasks[task];
+			current->nodes = Perft(worker->layout, &current->position, current->depth, stack);
+		}
+	}
+
+	free(stack);
+	return NULL;
+}
+
+// Write square name (like "c3") of the given bit
+void SquareName(const struct layout * layout, int bit, char * name)
+{
+	sprintf(name, "%c%d", 'a' + layout->col[bit], layout->side - layout->row[bit]);
+}
+
+// Write move name: squares separated by "-" for ordinary move and by ":" for capture
+void MoveName(const struct layout * layout, const struct flatmove * move, char * name)
+{
+	SquareName(layout, move->from, name);
+	if (move->length == 0 || move->length > MAXPATH)
+	{
+		strcat(name, move->length == 0 ? "-" : ":");
+		SquareName(layout, move->to, name + strlen(name));
+		return;
+	}
+
+	for (int i = 0; i < move->length; i++)
+	{
+		strcat(name, ":");
+		SquareName(layout, move->path[i], name + strlen(name));
+	}
+}
+
+// Return monotonic time in seconds
+double Now()
+{
+	struct timespec time;
+	clock_gettime(CLOCK_MONOTONIC, &time);
+	return time.tv_sec + time.tv_nsec / 1e9;
+}
+
+// Score the position from the point of view of the side to move
+int Evaluate(const struct layout * layout, const struct position * position)
+{
+	int score[2] = {};
+	for (int color = 0; color < 2; color++)
+	{
+		// Material
+		score[color] += MANVALUE * BitCount(position->men[color]) + KINGVALUE * BitCount(position->kings[color]);
+
+		// Men are worth more the closer they are to becoming kings, and guard own last row
+		struct bitboard men = position->men[color];
+		for (int bit = BitPop(&men); bit != -1; bit = BitPop(&men))
+		{
+			int advance = color == 0 ? layout->row[bit] : layout->side - 1 - layout->row[bit];
+			score[color] += ADVANCEVALUE * advance;
+			if (advance == 0)
+				score[color] += GUARDVALUE;
+		}
+	}
+
+	return score[position->color] - score[(position->color + 1) % 2];
+}
+
+// Negamax search with alpha-beta pruning; captures are searched beyond the depth until the position is quiet
+int AlphaBeta(struct searcher * searcher, const struct position * position, int depth, int ply, int alpha, int beta)
+{
+	// Check the time and other threads once in a while
+	searcher->nodes++;
+	if ((searcher->nodes & (CHECKNODES - 1)) == 0)
+	{
+		if (searcher->deadline > 0 && Now() >= searcher->deadline)
+			searcher->stop = true;
+		if (searcher->abort != NULL && atomic_load_explicit(searcher->abort, memory_order_relaxed))
+			searcher->stop = true;
+	}
+	if (searcher->stop)
+		return 0;
+
+	// Positions with few pieces are solved in the tablebase
+	int value;
+	if (searcher->tablebase != NULL && ProbeTablebase(searcher->tablebase, position, &value))
+	{
+		searcher->tbhits++;
+		// Plies to the end are counted from the root, so that a win found at a smaller ply is better
+		int score = TablebaseScore(value);
+		if (score > 0)
+			score -= ply;
+		if (score < 0)
+			score += ply;
+		return score;
+	}
+
+	// Look the position up in transposition table
+	struct ttdata entry = {.move = -1};
+	if (searcher->table != NULL)
+	{
+		searcher->probes++;
+		if (ProbeTable(searcher->table, position->hash, &entry))
+		{
+			searcher->hits++;
+			// Won and lost scores (of the search and the tablebase) are stored relative to the position
+			int score = entry.score;
+			if (score > DECIDED)
+				score -= ply;
+			if (score < -DECIDED)
+				score += ply;
+
+			if (entry.depth >= depth && (entry.bound == exact || (entry.bound == lower && score >= beta) || (entry.bound == upper && score <= alpha)))
+				return score;
+		}
+	}
+
+	struct flatmove * list = searcher->stack + ply * MAXMOVES;
+	int count = GenerateMoves(searcher->layout, position, list, MAXMOVES);
+	if (count == 0)
+		return -WIN + ply;
+	if (count > MAXMOVES)
+		count = MAXMOVES;
+	if ((depth <= 0 && list[0].length == 0) || ply >= MAXPLY - 1)
+		return Evaluate(searcher->layout, position);
+
+	// Order moves: the best move from the table, then captures of the most valuable pieces and promotions,
+	// then moves that caused cutoffs at the same ply, then moves that caused most cutoffs anywhere
+	int order[count];
+	for (int i = 0; i < count; i++)
+	{
+		int key = MoveKey(&list[i]);
+		if (key == entry.move)
+			order[i] = ORDERHASH;
+		else if (list[i].length > 0 || list[i].promotion)
+			order[i] = ORDERCAPTURE + 3 * BitCount(BitAnd(list[i].captured, position->kings[(position->color + 1) % 2]))
+				+ BitCount(list[i].captured) + list[i].promotion;
+		else if (key == searcher->killers[ply][0])
+			order[i] = ORDERKILLER + 1;
+		else if (key == searcher->killers[ply][1])
+			order[i] = ORDERKILLER;
+		else
+			order[i] = searcher->history[list[i].from * searcher->layout->bits + list[i].to];
+	}
+
+	int best = -WIN, bestindex = 0, start = alpha;
+	for (int i = 0; i < count; i++)
+	{
+		// Bring the next move by order forward (cutoffs usually come before the whole list is sorted)
+		int pick = i;
+		for (int j = i + 1; j < count; j++)
+		{
+			if (order[j] > order[pick])
+				pick = j;
+		}
+		if (pick != i)
+		{
+			struct flatmove tmp = list[i];
+			list[i] = list[pick];
+			list[pick] = tmp;
+			int value = order[i];
+			order[i] = order[pick];
+			order[pick] = value;
+		}
+
+		struct position next = *position;
+		MakeMove(&next, &list[i]);
+		int score = -AlphaBeta(searcher, &next, depth - 1, ply + 1, -beta, -alpha);
+		if (searcher->stop)
+			return 0;
+
+		if (score > best)
+		{
+			best = score;
+			bestindex = i;
+		}
+		if (best > alpha)
+			alpha = best;
+		if (alpha >= beta)
+		{
+			// Simple moves that refute the position are tried early in its siblings and other positions
+			searcher->cutoffs++;
+			searcher->firstcutoffs += i == 0;
+			if (list[i].length == 0 && !list[i].promotion)
+			{
+				int key = MoveKey(&list[i]);
+				if (searcher->killers[ply][0] != key)
+				{
+					searcher->killers[ply][1] = searcher->killers[ply][0];
+					searcher->killers[ply][0] = key;
+				}
+				uint32_t * history = &searcher->history[list[i].from * searcher->layout->bits + list[i].to];
+				if (*history < HISTORYMAX)
+					*history += depth > 0 ? depth * depth : 1;
+			}
+			break;
+		}
+	}
+
+	if (searcher->table != NULL)
+	{
+		enum bound bound = best <= start ? upper : (best >= beta ? lower : exact);
+		int score = best;
+		if (score > DECIDED)
+			score += ply;
+		if (score < -DECIDED)
+			score -= ply;
+		StoreTable(searcher->table, position->hash, depth, bound, score, MoveKey(&list[bestindex]));
+	}
+
+	return best;
+}
+
+// Search the position with iterative deepening until the depth is reached or the budget (in milliseconds) is over
+// Best move of the last completed iteration is stored in the searcher; returns false if there are no moves
+// Extra threads search the same position and share their results through the transposition table (Lazy SMP)
+bool FindMove(const struct layout * layout, const struct position * position, int depth, int budget, int threads, struct table * table, const struct tablebase * tablebase, struct searcher * searcher)
+{
+	atomic_bool abort;
+	atomic_init(&abort, false);
+	memset(searcher, 0, sizeof(struct searcher));
+	searcher->layout = layout;
+	searcher->table = table;
+	searcher->tablebase = tablebase;
+	searcher->abort = &abort;
+	if (table != NULL)
+		table->generation++;
+	// The next iteration usually takes longer than all previous ones, so it is not started after half of the budget
+	double start = Now();
+	searcher->deadline = budget > 0 ? start + (budget > 2 * RESERVE ? budget - RESERVE : budget / 2.0) / 1000.0 : 0;
+	searcher->soft = budget > 0 ? start + budget / 2000.0 : 0;
+	searcher->stack = malloc(sizeof(struct flatmove) * MAXMOVES * MAXPLY);
+
+	struct flatmove * list = searcher->stack;
+	int count = GenerateMoves(layout, position, list, MAXMOVES);
+	if (count > MAXMOVES)
+		count = MAXMOVES;
+	if (count == 0)
+	{
+		free(searcher->stack);
+		return false;
+	}
+	searcher->best = list[0];
+
+	// The only move is played without search
+	if (count == 1)
+	{
+		free(searcher->stack);
+		return true;
+	}
+
+	searcher->history = calloc(layout->bits * layout->bits, sizeof(uint32_t));
+	for (int ply = 0; ply < MAXPLY; ply++)
+		searcher->killers[ply][0] = searcher->killers[ply][1] = -1;
+
+	// Start helper threads (without the table they would only repeat the same search)
+	if (table == NULL)
+		threads = 1;
+	struct helper * helpers = calloc(threads > 1 ? threads - 1 : 1, sizeof(struct helper));
+	for (int i = 0; i < threads - 1; i++)
+	{
+		helpers[i].id = i + 1;
+		helpers[i].position = position;
+		helpers[i].depth = depth;
+		helpers[i].searcher = *searcher;
+		helpers[i].searcher.stack = malloc(sizeof(struct flatmove) * MAXMOVES * MAXPLY);
+		helpers[i].searcher.history = calloc(layout->bits * layout->bits, sizeof(uint32_t));
+		pthread_create(&helpers[i].thread, NULL, SearchHelper, &helpers[i]);
+	}
+
+	Deepen(searcher, position, depth, list, count, 1);
+
+	// Stop helpers and add their statistics
+	atomic_store(&abort, true);
+	for (int i = 0; i < threads - 1; i++)
+	{
+		pthread_join(helpers[i].thread, NULL);
+		searcher->nodes += helpers[i].searcher.nodes;
+		searcher->probes += helpers[i].searcher.probes;
+		searcher->hits += helpers[i].searcher.hits;
+		searcher->tbhits += helpers[i].searcher.tbhits;
+		searcher->cutoffs += helpers[i].searcher.cutoffs;
+		searcher->firstcutoffs += helpers[i].searcher.firstcutoffs;
+		free(helpers[i].searcher.stack);
+		free(helpers[i].searcher.history);
+	}
+	free(helpers);
+
+	free(searcher->stack);
+	free(searcher->history);
+	searcher->stack = NULL;
+	searcher->history = NULL;
+	searcher->abort = NULL;
+	return true;
+}
+
+// Search root moves with increasing depth starting from the given one
+void Deepen(struct searcher * searcher, const struct position * position, int depth, struct flatmove * list, int count, int first)
+{
+	for (int d = first; d <= depth && d < MAXPLY; d++)
+	{
+		int alpha = -WIN - 1, bestindex = 0;
+		for (int i = 0; i < count; i++)
+		{
+			struct position next = *position;
+			MakeMove(&next, &list[i]);
+			int score = -AlphaBeta(searcher, &next, d - 1, 1, -WIN - 1, -alpha);
+			if (searcher->stop)
+				break;
+			if (score > alpha)
+			{
+				alpha = score;
+				bestindex = i;
+			}
+		}
+		if (searcher->stop)
+			break;
+
+		// Search the best move first in the next iteration
+		struct flatmove best = list[bestindex];
+		memmove(list + 1, list, sizeof(struct flatmove) * bestindex);
+		list[0] = best;
+		searcher->best = best;
+		searcher->depth = d;
+		searcher->score = alpha;
+
+		// Stop if the result is already known or there is no time for the next iteration
+		if (alpha >= WIN - MAXPLY || alpha <= -WIN + MAXPLY)
+			break;
+		if (searcher->soft > 0 && Now() >= searcher->soft)
+			break;
+	}
+}
+
+// Search the position in a helper thread until the main thread is done
+// Helpers start from different depths and root move orders, so that they fill the table with different positions
+void * SearchHelper(void * arg)
+{
+	struct helper * helper = arg;
+	struct searcher * searcher = &helper->searcher;
+	struct flatmove * list = searcher->stack;
+	int count = GenerateMoves(searcher->layout, helper->position, list, MAXMOVES);
+	if (count > MAXMOVES)
+		count = MAXMOVES;
+
+	// Rotate root moves
+	int shift = helper->id % count;
+	struct flatmove * rotated = searcher->stack + MAXMOVES;
+	memcpy(rotated, list + shift, sizeof(struct flatmove) * (count - shift));
+	memcpy(rotated + count - shift, list, sizeof(struct flatmove) * shift);
+	memcpy(list, rotated, sizeof(struct flatmove) * count);
+
+	// Helpers go one depth further than the main thread, so that they do not stop too early
+	Deepen(searcher, helper->position, helper->depth + 1, list, count, 1 + helper->id % 2);
+	return NULL;
+}
+
+// Let computer choose and play a move for the side to move
+void ComputerMove(struct game * game)
+{
+	PrintBoard(game);
+	if (!game->headless)
+	{
+		printf("\e[1m%s's move\e[0m\nThinking...\n", game->position.color == 0 ? "Black" : "White");
+		fflush(stdout);
+	}
+
+	// Moves of the opening book are played without search
+	double start = Now();
+	int color = game->position.color;
+	struct flatmove move;
+	struct searcher searcher = {};
+	game->random = Mix(game->random);
+	bool found = game->book != NULL && ProbeBook(game->book, &game->layout, &game->position, game->random, &move);
+	if (!found)
+	{
+		found = FindMove(&game->layout, &game->position, game->depth, Allot(game), game->threads, game->table, game->tablebase, &searcher);
+		move = searcher.best;
+	}
+	game->nodes += searcher.nodes;
+	game->lastdepth = searcher.depth;
+	game->lastnodes = searcher.nodes;
+	game->lasttime = Now() - start;
+	if (game->clocked)
+		game->clock[color] += game->increment - (int)(game->lasttime * 1000);
+	if (!found)
+		return;
+	PlayMove(game, &move);
+	PrintBoard(game);
+}
+
+// Return time in milliseconds for computer's move: the per-move limit, or a share of the remaining time on the game clock
+int Allot(const struct game * game)
+{
+	if (!game->clocked)
+		return game->budget;
+
+	int remaining = game->clock[game->position.color];
+	int budget = remaining / MOVESTOGO + game->increment;
+	// Some time is always left for the next moves
+	if (budget > remaining / 2)
+		budget = remaining / 2;
+	if (game->budget > 0 && budget > game->budget)
+		budget = game->budget;
+	return budget > 1 ? budget : 1;
+}
+
+// Parse "MS[+MS]" of the game clock option, returns false if it is wrong
+bool ParseClock(const char * text, int * clock, int * increment)
+{
+	char * end;
+	*clock = strtol(text, &end, 10);
+	*increment = *end == '+' ? strtol(end + 1, &end, 10) : 0;
+	return *end == '\0' && *clock > 0 && *increment >= 0;
+}
+
+// Play the move on the board showing every capture
+void PlayMove(struct game * game, const struct flatmove * move)
+{
+	struct square * piece = SquareAt(game, move->from);
+	int enemy = (piece->type % 2 + 1) % 2;
+	piece->pcselected = true;
+	Animate(game, DELAY);
+
+	// Go through the landing squares, captured pieces are removed when the move is over
+	for (int i = 0; i < move->length && i < MAXPATH; i++)
+	{
+		piece = SimpleMove(game, piece, SquareAt(game, move->path[i]));
+		Animate(game, DELAY);
+	}
+	if (piece->index != move->to)
+		piece = SimpleMove(game, piece, SquareAt(game, move->to));
+
+	struct bitboard captured = move->captured;
+	RecordMove(game, move, BitAnd(captured, game->position.kings[enemy]));
+	for (int bit = BitPop(&captured); bit != -1; bit = BitPop(&captured))
+	{
+		PlacePiece(game, SquareAt(game, bit), nopiece);
+		game->pieces[enemy]--;
+	}
+	if (move->promotion)
+		PlacePiece(game, piece, piece->type + 2);
+
+	piece->pcselected = false;
+}
+
+// Start the game record from the current position
+void ResetLog(struct game * game)
+{
+	game->logcount = game->logsize = 0;
+	game->start = game->position;
+	LogStart(game);
+}
+
+// Append the move to the game record, undone moves after it are dropped
+void RecordMove(struct game * game, const struct flatmove * move, struct bitboard kings)
+{
+	if (game->logcount == game->logcapacity)
+	{
+		game->logcapacity = game->logcapacity > 0 ? game->logcapacity * 2 : 64;
+		game->log = realloc(game->log, sizeof(struct logmove) * game->logcapacity);
+	}
+	game->log[game->logcount].move = *move;
+	game->log[game->logcount].kings = kings;
+	game->logsize = ++game->logcount;
+	LogMove(game, move);
+}
+
+// Add the capture of the chain's link to the move of the player
+void LogCapture(struct game * game, struct chain * link)
+{
+	struct flatmove * move = &game->pending.move;
+	int bit = link->tocapture->index;
+	// King goes further along the diagonal after the captured piece
+	if (BitTest(move->captured, bit))
+	{
+		if (move->length <= MAXPATH)
+			move->path[move->length - 1] = link->square->index;
+		return;
+	}
+
+	BitSet(&move->captured, bit);
+	if (link->tocapture->type / 2 == 1)
+		BitSet(&game->pending.kings, bit);
+	if (move->length < MAXPATH)
+		move->path[move->length] = link->square->index;
+	move->length++;
+}
+
+// Play the move on the board without showing it and pass the turn
+void ReplayMove(struct game * game, const struct flatmove * move)
+{
+	struct square * piece = SquareAt(game, move->from);
+	enum piece type = piece->type;
+	int enemy = (type % 2 + 1) % 2;
+	PlacePiece(game, piece, nopiece);
+	struct bitboard captured = move->captured;
+	for (int bit = BitPop(&captured); bit != -1; bit = BitPop(&captured))
+	{
+		PlacePiece(game, SquareAt(game, bit), nopiece);
+		game->pieces[enemy]--;
+	}
+	PlacePiece(game, SquareAt(game, move->to), move->promotion ? type + 2 : type);
+
+	game->turn++;
+	SetColor(&game->position, game->turn % 2);
+}
+
+// Take back the last played move (false if there is none)
+bool Undo(struct game * game)
+{
+	if (game->logcount == 0)
+		return false;
+
+	struct logmove * entry = &game->log[--game->logcount];
+	struct square * piece = SquareAt(game, entry->move.to);
+	enum piece type = piece->type;
+	int enemy = (type % 2 + 1) % 2;
+	PlacePiece(game, piece, nopiece);
+	PlacePiece(game, SquareAt(game, entry->move.from), entry->move.promotion ? type - 2 : type);
+	// Put back captured pieces
+	struct bitboard captured = entry->move.captured;
+	for (int bit = BitPop(&captured); bit != -1; bit = BitPop(&captured))
+	{
+		PlacePiece(game, SquareAt(game, bit), BitTest(entry->kings, bit) ? enemy + 2 : enemy);
+		game->pieces[enemy]++;
+	}
+
+	game->turn--;
+	SetColor(&game->position, game->turn % 2);
+	LogUndo(game);
+	return true;
+}
+
+// Play again the last undone move (false if there is none)
+bool Redo(struct game * game)
+{
+	if (game->logcount == game->logsize)
+		return false;
+
+	LogMove(game, &game->log[game->logcount].move);
+	ReplayMove(game, &game->log[game->logcount++].move);
+	return true;
+}
+
+// Write played moves of the game to the file in Portable Draughts Notation
+int ExportGame(struct game * game, char * filename)
+{
+	FILE * file = fopen(filename, "w");
+	if (file == NULL)
+		return 1;
+
+	// Tags
+	time_t now = time(NULL);
+	struct tm * date = localtime(&now);
+	char fen[MAXBITS * 6];
+	WriteFen(&game->layout, &game->start, fen);
+	fprintf(file, "[Event \"Checkers\"]\n");
+	fprintf(file, "[Date \"%04d.%02d.%02d\"]\n", date->tm_year + 1900, date->tm_mon + 1, date->tm_mday);
+	fprintf(file, "[White \"%s\"]\n[Black \"%s\"]\n", game->computer[1] ? "Computer" : "Player", game->computer[0] ? "Computer" : "Player");
+	fprintf(file, "[Result \"*\"]\n");
+	fprintf(file, "[GameType \"25,W,%d,%d,A0,0\"]\n", game->side, game->side);
+	fprintf(file, "[FEN \"%s\"]\n\n", fen);
+
+	// Moves with numbers before white ones, lines are kept shorter than 80 characters
+	int color = game->start.color, number = 1, column = 0;
+	for (int i = 0; i < game->logcount; i++)
+	{
+		char name[8 * (MAXPATH + 2) + 16] = "";
+		if (color == 1 || i == 0)
+			sprintf(name, color == 1 ? "%d. " : "%d... ", number);
+		MoveName(&game->layout, &game->log[i].move, name + strlen(name));
+		int length = strlen(name);
+		if (column > 0 && column + 1 + length >= 80)
+		{
+			fprintf(file, "\n");
+			column = 0;
+		}
+		column += fprintf(file, "%s%s", column > 0 ? " " : "", name);
+
+		if (color == 0)
+			number++;
+		color = (color + 1) % 2;
+	}
+	fprintf(file, "%s*\n", column > 0 ? " " : "");
+
+	return fclose(file) != 0;
+}
+
+// Write the position in FEN tag's format: side to move, then white and black pieces (kings with "K")
+void WriteFen(const struct layout * layout, const struct position * position, char * text)
+{
+	text += sprintf(text, "%c", position->color == 1 ? 'W' : 'B');
+	for (int color = 1; color >= 0; color--)
+	{
+		text += sprintf(text, ":%c", color == 1 ? 'W' : 'B');
+		bool first = true;
+		for (int i = 0; i < layout->bits; i++)
+		{
+			bool man = BitTest(position->men[color], i), king = BitTest(position->kings[color], i);
+			if (!man && !king)
+				continue;
+
+			if (!first)
+				*text++ = ',';
+			if (king)
+				*text++ = 'K';
+			SquareName(layout, i, text);
+			text += strlen(text);
+			first = false;
+		}
+	}
+}
+
+// Set the game from Portable Draughts Notation: position of FEN tag (or the initial one) and moves played from it
+// Returns 2 if the game has different board size and 3 if it cannot be read
+int ImportGame(struct game * game, char * data)
+{
+	if (PdnSide(data) != game->side)
+		return 2;
+
+	// Starting position
+	char * fen = strstr(data, "[FEN \"");
+	if (fen != NULL)
+	{
+		struct position position;
+		if (ParseFen(&game->layout, fen + 6, &position) != 0)
+			return 3;
+		SetPosition(game, &position);
+	}
+	else
+	{
+		struct position empty = {};
+		SetPosition(game, &empty);
+		InitializePieces(game);
+	}
+
+	// Moves
+	struct flatmove * list = malloc(sizeof(struct flatmove) * MAXMOVES);
+	int result = 0;
+	char * text = data;
+	while (*text != '\0' && result == 0)
+	{
+		// Skip tags, comments, variations and numeric annotations
+		if (strchr("[{;", *text) != NULL)
+		{
+			char * end = strchr(text, *text == '[' ? ']' : *text == '{' ? '}' : '\n');
+			text = end != NULL ? end + 1 : text + strlen(text);
+			continue;
+		}
+		if (*text == '(')
+		{
+			int depth = 0;
+			do
+				depth += *text == '(' ? 1 : *text == ')' ? -1 : 0;
+			while (*++text != '\0' && depth > 0);
+			continue;
+		}
+		if (isspace((unsigned char)*text) || *text == '!' || *text == '?')
+		{
+			text++;
+			continue;
+		}
+		if (*text == '$')
+		{
+			text++;
+			while (isdigit((unsigned char)*text))
+				text++;
+			continue;
+		}
+
+		// Game result ends the moves
+		size_t length = strcspn(text, " \t\r\n{(;");
+		char * results[] = {"*", "1-0", "0-1", "1/2-1/2", "2-0", "0-2", "1-1", "0-0"};
+		bool over = false;
+		for (int i = 0; i < 8; i++)
+			over = over || (strlen(results[i]) == length && strncmp(text, results[i], length) == 0);
+		if (over)
+			break;
+
+		// Skip move number
+		char * number = text;
+		while (isdigit((unsigned char)*number))
+			number++;
+		if (*number == '.')
+		{
+			while (*number == '.')
+				number++;
+			text = number;
+			continue;
+		}
+
+		// Read squares of the move
+		int squares[MAXPATH + 2], count = 0;
+		while (true)
+		{
+			int bit = ParseSquare(&game->layout, &text);
+			if (bit == -1)
+				break;
+			if (count < MAXPATH + 2)
+				squares[count++] = bit;
+			// Squares are separated by "-" for ordinary move and by "x" or ":" for capture
+			if (*text != '-' && *text != 'x' && *text != ':')
+				break;
+			text++;
+		}
+		if (count < 2 || (*text != '\0' && !isspace((unsigned char)*text) && strchr("!?{(;$", *text) == NULL))
+		{
+			result = 3;
+			break;
+		}
+
+		struct flatmove move;
+		if (!FindPlayedMove(&game->layout, &game->position, squares, count, list, &move))
+		{
+			result = 3;
+			break;
+		}
+
+		struct bitboard kings = BitAnd(move.captured, BitOr(game->position.kings[0], game->position.kings[1]));
+		RecordMove(game, &move, kings);
+		ReplayMove(game, &move);
+	}
+
+	free(list);
+	return result;
+}
+
+// Find the legal move that goes through the squares (starting and landing ones), list is used for generated moves
+bool FindPlayedMove(const struct layout * layout, const struct position * position, const int * squares, int count, struct flatmove * list, struct flatmove * move)
+{
+	int moves = GenerateMoves(layout, position, list, MAXMOVES);
+	for (int i = 0; i < moves && i < MAXMOVES; i++)
+	{
+		// Every capture has its landing square, a move without capture has only the final one
+		int length = list[i].length > 0 ? list[i].length : 1;
+		if (list[i].from != squares[0] || list[i].to != squares[count - 1] || length != count - 1)
+			continue;
+
+		bool found = true;
+		for (int j = 1; j < count - 1 && j - 1 < MAXPATH; j++)
+			found = found && list[i].path[j - 1] == squares[j];
+		if (found)
+		{
+			*move = list[i];
+			return true;
+		}
+	}
+
+	// Player is able to stop capturing on any square of the sequence
+	for (int i = 0; i < moves && i < MAXMOVES; i++)
+	{
+		if (list[i].from == squares[0] && CutCapture(layout, position, &list[i], squares + 1, count - 1, move))
+			return true;
+	}
+
+	return false;
+}
+
+// Make the move that stops after the given landing squares of the capture sequence (false if they are not its beginning)
+bool CutCapture(const struct layout * layout, const struct position * position, const struct flatmove * move, const int * squares, int count, struct flatmove * cut)
+{
+	if (count > move->length || count > MAXPATH)
+		return false;
+
+	memset(cut, 0, sizeof(struct flatmove));
+	cut->from = move->from;
+	cut->length = count;
+	for (int i = 0, square = move->from; i < count; square = squares[i++])
+	{
+		if (move->path[i] != squares[i])
+			return false;
+
+		// Find the captured piece on the diagonal to the landing square (king can go through squares of pieces it has captured before)
+		for (int d = 0; d < 4; d++)
+		{
+			int captured = -1, next = layout->adjacent[square][d];
+			for (; next != -1 && next != squares[i]; next = layout->adjacent[next][d])
+			{
+				if (BitTest(move->captured, next) && !BitTest(cut->captured, next))
+					captured = next;
+			}
+			if (next == squares[i] && captured != -1)
+				BitSet(&cut->captured, captured);
+		}
+		cut->path[i] = squares[i];
+	}
+	cut->to = squares[count - 1];
+
+	// Man that stops on the last row becomes a king
+	int color = position->color;
+	cut->promotion = BitTest(position->men[color], move->from) && BitTest(layout->lastrow[color], cut->to);
+	return true;
+}
+
+// Return board size of the game in Portable Draughts Notation: width from GameType tag,
+// size of the board of the given game type or 8 if there is no tag
+int PdnSide(char * data)
+{
+	char * tag = strstr(data, "[GameType \"");
+	if (tag == NULL)
+		return 8;
+
+	tag += strlen("[GameType \"");
+	int type = atoi(tag), side = 0;
+	if (sscanf(tag, "%*d,%*c,%d", &side) == 1)
+		return side;
+
+	return type == 20 ? 10 : type == 27 ? 12 : 8;
+}
+
+// Read position from the value of FEN tag, like "W:Wa1,c1,Kd4:Bb8" or "B:W21-32:B1-12"
+int ParseFen(const struct layout * layout, char * text, struct position * position)
+{
+	memset(position, 0, sizeof(struct position));
+	if (*text != 'W' && *text != 'B')
+		return 3;
+
+	position->color = *text++ == 'W';
+	while (*text == ':')
+	{
+		text++;
+		if (*text != 'W' && *text != 'B')
+			return 3;
+
+		int color = *text++ == 'W';
+		// Read comma-separated squares and ranges of squares
+		while (*text != ':' && *text != '"' && *text != '\0')
+		{
+			bool king = *text == 'K';
+			if (king)
+				text++;
+			int first = ParseSquare(layout, &text), last = first;
+			if (first != -1 && *text == '-')
+			{
+				text++;
+				last = ParseSquare(layout, &text);
+			}
+			if (first == -1 || last == -1 || last < first)
+				return 3;
+
+			for (int i = first; i <= last; i++)
+			{
+				if (layout->row[i] != -1)
+					BitSet(king ? &position->kings[color] : &position->men[color], i);
+			}
+			if (*text == ',')
+				text++;
+		}
+	}
+	position->hash = HashPosition(layout, position);
+
+	return 0;
+}
+
+// Read square in algebraic ("c3") or numeric notation (dark squares are numbered from the top left one) and return its bit
+int ParseSquare(const struct layout * layout, char ** text)
+{
+	char * start = *text;
+	int col = -1, row = -1;
+	if (islower((unsigned char)**text))
+		col = *(*text)++ - 'a';
+	if (!isdigit((unsigned char)**text))
+		return -1;
+
+	int number = strtol(*text, text, 10);
+	if (col != -1)
+	{
+		row = layout->side - number;
+		if (col >= layout->side || row < 0 || row >= layout->side)
+			return -1;
+		return layout->index[row][col];
+	}
+
+	// Find the dark square with the given number
+	for (int i = 0; i < layout->bits; i++)
+	{
+		if (layout->row[i] != -1 && --number == 0)
+			return i;
+	}
+
+	*text = start;
+	return -1;
+}
+
+// Allocate transposition table of the given size (NULL if the size is 0)
+struct table * CreateTable(int megabytes)
+{
+	if (megabytes <= 0)
+		return NULL;
+
+	// Number of buckets is the biggest power of two that fits
+	uint64_t buckets = 1;
+	while (buckets * 2 * 2 * sizeof(struct ttentry) <= (uint64_t)megabytes << 20)
+		buckets *= 2;
+
+	struct table * table = calloc(1, sizeof(struct table));
+	table->entries = calloc(buckets * 2, sizeof(struct ttentry));
+	table->mask = buckets - 1;
+	return table;
+}
+
+// Free transposition table
+void FreeTable(struct table * table)
+{
+	if (table == NULL)
+		return;
+
+	free(table->entries);
+	free(table);
+}
+
+// Find the position in transposition table
+bool ProbeTable(struct table * table, uint64_t hash, struct ttdata * entry)
+{
+	struct ttentry * bucket = &table->entries[(hash & table->mask) * 2];
+	for (int i = 0; i < 2; i++)
+	{
+		uint64_t check = atomic_load_explicit(&bucket[i].check, memory_order_relaxed);
+		uint64_t data = atomic_load_explicit(&bucket[i].data, memory_order_relaxed);
+		if ((check ^ data) != hash || data == 0)
+			continue;
+
+		entry->move = data & ((1 << TTSCORE) - 1);
+		if (entry->move == (1 << TTSCORE) - 1)
+			entry->move = -1;
+		entry->score = (int)((data >> TTSCORE) & ((1 << 18) - 1)) - (1 << 17);
+		entry->depth = (data >> TTDEPTH) & 127;
+		entry->bound = (data >> TTBOUND) & 3;
+		entry->generation = (data >> TTGENERATION) & 255;
+		return true;
+	}
+
+	return false;
+}
+
+// Store search result in transposition table
+void StoreTable(struct table * table, uint64_t hash, int depth, enum bound bound, int score, int move)
+{
+	if (depth < 0)
+		depth = 0;
+	int generation = table->generation & 255;
+	uint64_t data = (uint64_t)(move == -1 ? (1 << TTSCORE) - 1 : move)
+		| (uint64_t)(score + (1 << 17)) << TTSCORE
+		| (uint64_t)depth << TTDEPTH
+		| (uint64_t)bound << TTBOUND
+		| (uint64_t)generation << TTGENERATION;
+
+	// Replace the deep entry if it is the same position, if it is not deeper or if it is left from older search
+	struct ttentry * bucket = &table->entries[(hash & table->mask) * 2];
+	uint64_t check = atomic_load_explicit(&bucket[0].check, memory_order_relaxed);
+	uint64_t old = atomic_load_explicit(&bucket[0].data, memory_order_relaxed);
+	int slot = 1;
+	if ((check ^ old) == hash || (int)((old >> TTDEPTH) & 127) <= depth || (int)((old >> TTGENERATION) & 255) != generation)
+		slot = 0;
+
+	atomic_store_explicit(&bucket[slot].check, hash ^ data, memory_order_relaxed);
+	atomic_store_explicit(&bucket[slot].data, data, memory_order_relaxed);
+}
+
+// Pack the move into a number that identifies it among moves of the position
+int MoveKey(const struct flatmove * move)
+{
+	int step = move->length > 0 ? move->path[0] : move->to;
+	return move->from | move->to << 9 | step << 18;
+}
+
+// Run "bench DEPTH [SIDE | FILE...] [--hash MB] [--threads N]": search positions to the given depth
+// without and with transposition table, and with N threads to measure time-to-depth speedup
+int BenchCommand(int argc, char * argv[])
+{
+	// Parse arguments
+	int depth = 0, hash = HASH, threads = 1, sources = 0;
+	char * source[argc + 1], * directory = NULL;
+	for (int i = 0; i < argc; i++)
+	{
+		if (strcmp(argv[i], "--hash") == 0 && i + 1 < argc)
+			hash = atoi(argv[++i]);
+		else if (strcmp(argv[i], "--tablebase") == 0 && i + 1 < argc)
+			directory = argv[++i];
+		else if (strcmp(argv[i], "--threads") == 0 && i + 1 < argc)
+			threads = atoi(argv[++i]);
+		else if (depth == 0)
+			depth = atoi(argv[i]);
+		else
+			source[sources++] = argv[i];
+	}
+	if (sources == 0)
+		source[sources++] = "8";
+	if (depth < 1 || depth >= MAXPLY || hash < 1 || threads < 1)
+	{
+		fprintf(stderr, "Usage: checkers bench DEPTH [SIDE | FILE...] [--hash MB] [--threads N] [--tablebase DIR]\n");
+		return 1;
+	}
+
+	double total = 0, paralleltotal = 0;
+	for (int i = 0; i < sources; i++)
+	{
+		struct game * game = SetupGame(source[i]);
+		if (game == NULL)
+			return 1;
+		struct tablebase * tablebase = directory != NULL ? LoadTablebase(directory, game->side) : NULL;
+
+		// Search without the table and with the new table
+		struct searcher plain, hashed;
+		double start = Now();
+		FindMove(&game->layout, &game->position, depth, 0, 1, NULL, NULL, &plain);
+		double plaintime = Now() - start;
+		struct table * table = CreateTable(hash);
+		start = Now();
+		FindMove(&game->layout, &game->position, depth, 0, 1, table, tablebase, &hashed);
+		double hashedtime = Now() - start;
+		total += hashedtime;
+
+		char name[8 * (MAXPATH + 2)];
+		MoveName(&game->layout, &hashed.best, name);
+		printf("%s: best %s, score %d\n", source[i], name, hashed.score);
+		printf("  no table: %llu nodes, %.3f s, first move cutoffs %.1f%%\n", (unsigned long long)plain.nodes, plaintime,
+			plain.cutoffs > 0 ? 100.0 * plain.firstcutoffs / plain.cutoffs : 0);
+		printf("  table %d MB: %llu nodes, %.3f s, hit rate %.1f%%, node reduction %.1f%%, first move cutoffs %.1f%%\n", hash,
+			(unsigned long long)hashed.nodes, hashedtime, hashed.probes > 0 ? 100.0 * hashed.hits / hashed.probes : 0,
+			plain.nodes > 0 ? 100.0 - 100.0 * hashed.nodes / plain.nodes : 0, hashed.cutoffs > 0 ? 100.0 * hashed.firstcutoffs / hashed.cutoffs : 0);
+		if (tablebase != NULL)
+			printf("  tablebase: %llu positions found\n", (unsigned long long)hashed.tbhits);
+
+		// Search with several threads and a new table
+		if (threads > 1)
+		{
+			FreeTable(table);
+			table = CreateTable(hash);
+			struct searcher parallel;
+			start = Now();
+			FindMove(&game->layout, &game->position, depth, 0, threads, table, tablebase, &parallel);
+			double paralleltime = Now() - start;
+			paralleltotal += paralleltime;
+			printf("  %d threads: %llu nodes, %.3f s, speedup %.2f\n", threads, (unsigned long long)parallel.nodes,
+				paralleltime, paralleltime > 0 ? hashedtime / paralleltime : 0);
+		}
+
+		FreeTable(table);
+		FreeTablebase(tablebase);
+		ClearBoard(game);
+		free(game);
+	}
+
+	if (threads > 1)
+		printf("total: 1 thread %.3f s, %d threads %.3f s, speedup %.2f\n", total, threads, paralleltotal,
+			paralleltotal > 0 ? total / paralleltotal : 0);
+
+	return 0;
+}
+
+// Run "analyze FILE [--depth N] [--threads N] [--output FILE]": map the file of binary records (saves written one after another)
+// and write legal move count, capture obligation, static evaluation and, with --depth, search result of every position to sidecar file
+int AnalyzeCommand(int argc, char * argv[])
+{
+	// Parse arguments
+	int depth = 0, threads = 1;
+	char * source = NULL, * target = NULL;
+	for (int i = 0; i < argc; i++)
+	{
+		if (strcmp(argv[i], "--depth") == 0 && i + 1 < argc)
+			depth = atoi(argv[++i]);
+		else if (strcmp(argv[i], "--threads") == 0 && i + 1 < argc)
+			threads = atoi(argv[++i]);
+		else if (strcmp(argv[i], "--output") == 0 && i + 1 < argc)
+			target = argv[++i];
+		else
+			source = argv[i];
+	}
+	if (source == NULL || depth < 0 || depth >= MAXPLY || threads < 1)
+	{
+		fprintf(stderr, "Usage: checkers analyze FILE [--depth N] [--threads N] [--output FILE]\n");
+		return 1;
+	}
+
+	// Map the file
+	int descriptor = open(source, O_RDONLY);
+	struct stat info;
+	if (descriptor == -1 || fstat(descriptor, &info) == -1)
+	{
+		fprintf(stderr, "Couldn't open %s\n", source);
+		return 1;
+	}
+	if (info.st_size < HEADER)
+	{
+		fprintf(stderr, "%s has no positions\n", source);
+		close(descriptor);
+		return 1;
+	}
+	const unsigned char * records = mmap(NULL, info.st_size, PROT_READ, MAP_PRIVATE, descriptor, 0);
+	close(descriptor);
+	if (records == MAP_FAILED)
+	{
+		fprintf(stderr, "Couldn't map %s\n", source);
+		return 1;
+	}
+	madvise((void *)records, info.st_size, MADV_SEQUENTIAL);
+
+	// Board size is taken from the first record
+	struct database * database = calloc(1, sizeof(struct database));
+	int side = records[5];
+	if (memcmp(records, MAGIC, 4) != 0 || CheckSide(side))
+	{
+		fprintf(stderr, "%s is not a file of binary positions\n", source);
+		munmap((void *)records, info.st_size);
+		free(database);
+		return 1;
+	}
+	InitializeLayout(&database->layout, side);
+	database->records = records;
+	database->size = RecordSize(side);
+	database->count = info.st_size / database->size;
+	database->depth = depth;
+
+	// Open sidecar file
+	char name[strlen(source) + 16];
+	if (target == NULL)
+	{
+		sprintf(name, "%s.analysis", source);
+		target = name;
+	}
+	database->output = fopen(target, "w");
+	if (database->output == NULL)
+	{
+		fprintf(stderr, "Couldn't create %s\n", target);
+		munmap((void *)records, info.st_size);
+		free(database);
+		return 1;
+	}
+	fprintf(database->output, "# record moves capture eval%s\n", depth > 0 ? " score best" : "");
+
+	// Analyse chunks of records on all threads
+	atomic_init(&database->next, 0);
+	atomic_init(&database->damaged, 0);
+	pthread_mutex_init(&database->lock, NULL);
+	pthread_cond_init(&database->done, NULL);
+	pthread_t workers[threads];
+	double start = Now();
+	for (int i = 1; i < threads; i++)
+		pthread_create(&workers[i], NULL, AnalyzeWorker, database);
+	AnalyzeWorker(database);
+	for (int i = 1; i < threads; i++)
+		pthread_join(workers[i], NULL);
+	double time = Now() - start;
+
+	printf("%zu positions (%dx%d) analysed in %.3f s, %.0f positions/s, %llu damaged\n", database->count, side, side,
+		time, time > 0 ? database->count / time : 0, (unsigned long long)atomic_load(&database->damaged));
+	if (info.st_size % database->size != 0)
+		printf("%zu bytes at the end of the file are not a complete record\n", (size_t)info.st_size % database->size);
+	printf("results are written to %s\n", target);
+
+	pthread_mutex_destroy(&database->lock);
+	pthread_cond_destroy(&database->done);
+	fclose(database->output);
+	munmap((void *)records, info.st_size);
+	free(database);
+	return 0;
+}
+
+// Analyse chunks of the database until all are taken, results of chunks are written in order of records
+void * AnalyzeWorker(void * arg)
+{
+	struct database * database = arg;
+	struct flatmove * list = malloc(sizeof(struct flatmove) * MAXMOVES);
+	// Every line has a number, a move name and a few short numbers
+	size_t linesize = 8 * (MAXPATH + 2) + 64;
+	char * text = malloc(CHUNK * linesize);
+	size_t chunks = (database->count + CHUNK - 1) / CHUNK;
+	struct position * positions = malloc(sizeof(struct position) * CHUNK);
+	int scores[CHUNK];
+	bool valid[CHUNK];
+	enum simd simd = BestSimd();
+
+	while (true)
+	{
+		size_t chunk = atomic_fetch_add(&database->next, 1);
+		if (chunk >= chunks)
+			break;
+
+		// Decode straight from the mapped file and evaluate the whole chunk at once
+		size_t first = chunk * CHUNK, count = database->count - first < CHUNK ? database->count - first : CHUNK;
+		for (size_t i = 0; i < count; i++)
+		{
+			valid[i] = DecodeRecord(&database->layout, &positions[i], database->records + (first + i) * database->size, database->size) == 0;
+			if (!valid[i])
+				memset(&positions[i], 0, sizeof(struct position));
+		}
+		EvaluateBatch(&database->layout, positions, count, scores, simd);
+
+		size_t length = 0;
+		for (size_t i = 0; i < count; i++)
+			length += AnalyzeRecord(database, first + i, valid[i] ? &positions[i] : NULL, scores[i], list, text + length);
+
+		// Wait for previous chunks to be written
+		pthread_mutex_lock(&database->lock);
+		while (database->written != chunk)
+			pthread_cond_wait(&database->done, &database->lock);
+		fwrite(text, 1, length, database->output);
+		database->written++;
+		pthread_cond_broadcast(&database->done);
+		pthread_mutex_unlock(&database->lock);
+	}
+
+	free(positions);
+	free(text);
+	free(list);
+	return NULL;
+}
+
+// Write the result line of the record and return its length
+size_t AnalyzeRecord(struct database * database, size_t index, const struct position * position, int score, struct flatmove * list, char * line)
+{
+	const struct layout * layout = &database->layout;
+	if (position == NULL)
+	{
+		atomic_fetch_add(&database->damaged, 1);
+		return sprintf(line, "%zu damaged\n", index);
+	}
+
+	int color = position->color;
+	int moves = GenerateMoves(layout, position, list, MAXMOVES);
+	bool capture = BitAny(ManCapturers(layout, position, color, position->men[color]))
+		|| BitAny(KingCapturers(layout, position, color, position->kings[color]));
+	size_t length = sprintf(line, "%zu %d %d %d", index, moves, capture, score);
+
+	// Search without table, so that results do not depend on order of positions
+	if (database->depth > 0)
+	{
+		struct searcher searcher;
+		char name[8 * (MAXPATH + 2)] = "-";
+		if (FindMove(layout, position, database->depth, 0, 1, NULL, NULL, &searcher))
+			MoveName(layout, &searcher.best, name);
+		else
+			searcher.score = -WIN;
+		length += sprintf(line + length, " %d %s", searcher.score, name);
+	}
+
+	line[length++] = '\n';
+	return length;
+}
+
+// Open the game log for appending and start its writing thread (NULL if the file cannot be opened)
+struct journal * OpenJournal(char * filename)
+{
+	int file = open(filename, O_WRONLY | O_CREAT | O_APPEND, 0644);
+	if (file == -1)
+		return NULL;
+
+	struct journal * journal = calloc(1, sizeof(struct journal));
+	journal->file = file;
+	journal->buffers[0] = malloc(JOURNALSIZE);
+	journal->buffers[1] = malloc(JOURNALSIZE);
+	// Games of different processes that share the file are numbered from random starts, so that their numbers do not meet
+	atomic_init(&journal->games, (uint32_t)Mix((uint64_t)(Now() * 1000000) ^ getpid()));
+	pthread_mutex_init(&journal->lock, NULL);
+	pthread_cond_init(&journal->full, NULL);
+	pthread_cond_init(&journal->space, NULL);
+	pthread_create(&journal->thread, NULL, JournalWriter, journal);
+	return journal;
+}
+
+// Write the rest of the game log and free it
+void CloseJournal(struct journal * journal)
+{
+	if (journal == NULL)
+		return;
+
+	pthread_mutex_lock(&journal->lock);
+	journal->closing = true;
+	pthread_cond_signal(&journal->full);
+	pthread_mutex_unlock(&journal->lock);
+	pthread_join(journal->thread, NULL);
+
+	if (close(journal->file) != 0 || journal->failed)
+		fprintf(stderr, "Couldn't write the game log\n");
+	pthread_mutex_destroy(&journal->lock);
+	pthread_cond_destroy(&journal->full);
+	pthread_cond_destroy(&journal->space);
+	free(journal->buffers[0]);
+	free(journal->buffers[1]);
+	free(journal);
+}
+
+// Add the record to the buffer of the game log, waits only if both buffers are full
+void AddRecord(struct journal * journal, enum entry kind, uint32_t game, const void * data, size_t size)
+{
+	unsigned char header[RECORDHEADER] = {size, size >> 8, kind, game, game >> 8, game >> 16, game >> 24};
+	pthread_mutex_lock(&journal->lock);
+	while (journal->length + RECORDHEADER + size > JOURNALSIZE)
+	{
+		pthread_cond_signal(&journal->full);
+		pthread_cond_wait(&journal->space, &journal->lock);
+	}
+
+	char * buffer = journal->buffers[journal->active] + journal->length;
+	memcpy(buffer, header, RECORDHEADER);
+	memcpy(buffer + RECORDHEADER, data, size);
+	journal->length += RECORDHEADER + size;
+	journal->records++;
+	if (journal->length >= JOURNALBATCH)
+		pthread_cond_signal(&journal->full);
+	pthread_mutex_unlock(&journal->lock);
+}
+
+// Write buffered records of the game log when a batch is collected, the period has passed or the log is closed
+void * JournalWriter(void * arg)
+{
+	struct journal * journal = arg;
+	pthread_mutex_lock(&journal->lock);
+	while (true)
+	{
+		struct timespec deadline;
+		clock_gettime(CLOCK_REALTIME, &deadline);
+		deadline.tv_sec += JOURNALPERIOD / 1000;
+		deadline.tv_nsec += JOURNALPERIOD % 1000 * 1000000L;
+		if (deadline.tv_nsec >= 1000000000L)
+		{
+			deadline.tv_sec++;
+			deadline.tv_nsec -= 1000000000L;
+		}
+		while (!journal->closing && journal->length < JOURNALBATCH)
+		{
+			if (pthread_cond_timedwait(&journal->full, &journal->lock, &deadline) == ETIMEDOUT)
+				break;
+		}
+		if (journal->length == 0)
+		{
+			if (journal->closing)
+				break;
+			continue;
+		}
+
+		// Swap buffers and write the full one without holding the lock
+		char * data = journal->buffers[journal->active];
+		size_t length = journal->length;
+		journal->active = (journal->active + 1) % 2;
+		journal->length = 0;
+		pthread_cond_broadcast(&journal->space);
+		pthread_mutex_unlock(&journal->lock);
+
+		size_t written = 0;
+		bool failed = false;
+		while (written < length && !failed)
+		{
+			ssize_t result = write(journal->file, data + written, length - written);
+			if (result > 0)
+				written += result;
+			else if (result == -1 && errno != EINTR)
+				failed = true;
+		}
+
+		pthread_mutex_lock(&journal->lock);
+		journal->writes++;
+		journal->failed = journal->failed || failed;
+	}
+	pthread_mutex_unlock(&journal->lock);
+
+	return NULL;
+}
+
+// Log the position that the game starts from
+void LogStart(struct game * game)
+{
+	if (game->journal == NULL)
+		return;
+
+	unsigned char record[SAVESIZE];
+	size_t size = EncodeRecord(&game->layout, &game->position, record);
+	AddRecord(game->journal, started, game->id, record, size);
+}
+
+// Log the move: number of squares (1 byte), then starting and landing squares (2 bytes each)
+void LogMove(struct game * game, const struct flatmove * move)
+{
+	if (game->journal == NULL)
+		return;
+
+	int squares[MAXPATH + 2];
+	int count = MoveSquares(move, squares);
+	unsigned char data[1 + 2 * (MAXPATH + 2)] = {count};
+	for (int i = 0; i < count; i++)
+	{
+		data[1 + i * 2] = squares[i];
+		data[2 + i * 2] = squares[i] >> 8;
+	}
+	AddRecord(game->journal, moved, game->id, data, 1 + count * 2);
+}
+
+// Log that the last move was taken back
+void LogUndo(struct game * game)
+{
+	if (game->journal != NULL)
+		AddRecord(game->journal, undone, game->id, NULL, 0);
+}
+
+// Log the end of the game: 0 - black has won, 1 - white has won, 2 - draw or stopped game
+void LogEnd(struct game * game, int winner)
+{
+	unsigned char result = winner;
+	if (game->journal != NULL)
+		AddRecord(game->journal, finished, game->id, &result, 1);
+}
+
+// Write squares of the move as in its name (starting square, then landing squares) and return their number
+int MoveSquares(const struct flatmove * move, int * squares)
+{
+	int count = 0;
+	squares[count++] = move->from;
+	if (move->length == 0 || move->length > MAXPATH)
+		squares[count++] = move->to;
+	else
+	{
+		for (int i = 0; i < move->length; i++)
+			squares[count++] = move->path[i];
+	}
+
+	return count;
+}
+
+// Run "replay FILE | -": read game log as a stream, check every move and print records of all games
+int ReplayCommand(int argc, char * argv[])
+{
+	if (argc < 1)
+	{
+		fprintf(stderr, "Usage: checkers replay FILE | -\n");
+		return 1;
+	}
+	FILE * file = strcmp(argv[0], "-") == 0 ? stdin : fopen(argv[0], "rb");
+	if (file == NULL)
+	{
+		fprintf(stderr, "Couldn't open %s\n", argv[0]);
+		return 1;
+	}
+
+	// Games that are being played, with positions before every move for undoing
+	struct replayed * games = NULL;
+	int active = 0, capacity = 0;
+	struct layout * layouts[MAXSIDE + 1] = {};
+	struct flatmove * list = malloc(sizeof(struct flatmove) * MAXMOVES);
+	uint64_t records = 0, played = 0, moves = 0, invalid = 0;
+
+	unsigned char header[RECORDHEADER], data[1 << 16];
+	while (fread(header, 1, RECORDHEADER, file) == RECORDHEADER)
+	{
+		size_t size = header[0] | header[1] << 8;
+		enum entry kind = header[2];
+		uint32_t id = header[3] | header[4] << 8 | header[5] << 16 | (uint32_t)header[6] << 24;
+		if (fread(data, 1, size, file) != size)
+			break;
+		records++;
+
+		// Find the game
+		int game = 0;
+		while (game < active && games[game].id != id)
+			game++;
+		struct replayed * current = game < active ? &games[game] : NULL;
+
+		if (kind == started)
+		{
+			int side = size > HEADER ? data[5] : 0;
+			if (side < MINSIDE || side > MAXSIDE)
+			{
+				printf("%u: damaged start\n", id);
+				invalid++;
+				continue;
+			}
+			if (layouts[side] == NULL)
+			{
+				layouts[side] = malloc(sizeof(struct layout));
+				InitializeLayout(layouts[side], side);
+			}
+			if (current == NULL)
+			{
+				if (active == capacity)
+				{
+					capacity = capacity > 0 ? capacity * 2 : 16;
+					games = realloc(games, sizeof(struct replayed) * capacity);
+				}
+				current = &games[active++];
+				memset(current, 0, sizeof(struct replayed));
+				current->id = id;
+			}
+			struct position position;
+			if (DecodeRecord(layouts[side], &position, data, size) != 0)
+			{
+				printf("%u: damaged start\n", id);
+				invalid++;
+				continue;
+			}
+			current->side = side;
+			current->count = 0;
+			if (current->capacity == 0)
+			{
+				current->capacity = 64;
+				current->positions = malloc(sizeof(struct position) * current->capacity);
+			}
+			current->positions[0] = position;
+			played++;
+
+			char fen[MAXBITS * 6];
+			WriteFen(layouts[side], &position, fen);
+			printf("%u: start %dx%d %s\n", id, side, side, fen);
+			continue;
+		}
+		if (current == NULL || current->side == 0)
+		{
+			printf("%u: record of unknown game\n", id);
+			invalid++;
+			continue;
+		}
+
+		const struct layout * layout = layouts[current->side];
+		struct position * position = &current->positions[current->count];
+		if (kind == moved)
+		{
+			// Check that the move is legal and play it
+			int squares[MAXPATH + 2], count = size > 0 ? data[0] : 0;
+			for (int i = 0; i < count && i < MAXPATH + 2 && (size_t)(2 + i * 2) < size; i++)
+				squares[i] = data[1 + i * 2] | data[2 + i * 2] << 8;
+			struct flatmove move;
+			if (count < 2 || count > MAXPATH + 2 || (size_t)(1 + count * 2) != size
+				|| !FindPlayedMove(layout, position, squares, count, list, &move))
+			{
+				printf("%u: invalid move\n", id);
+				invalid++;
+				continue;
+			}
+			if (current->count + 1 == current->capacity)
+			{
+				current->capacity *= 2;
+				current->positions = realloc(current->positions, sizeof(struct position) * current->capacity);
+				position = &current->positions[current->count];
+			}
+			current->positions[current->count + 1] = *position;
+			MakeMove(&current->positions[current->count + 1], &move);
+			current->count++;
+			moves++;
+
+			char name[8 * (MAXPATH + 2)];
+			MoveName(layout, &move, name);
+			printf("%u: %d%s %s\n", id, (current->count + 1) / 2, position->color == 1 ? "." : "...", name);
+		}
+		else if (kind == undone && current->count > 0)
+		{
+			current->count--;
+			printf("%u: undo\n", id);
+		}
+		else if (kind == finished)
+		{
+			char * results[] = {"black has won", "white has won", "no winner"};
+			char fen[MAXBITS * 6];
+			WriteFen(layout, position, fen);
+			printf("%u: %s after %d moves %s\n", id, size > 0 && data[0] < 3 ? results[data[0]] : "ended", current->count, fen);
+			free(current->positions);
+			*current = games[--active];
+		}
+	}
+
+	printf("%llu records, %llu games, %llu moves, %llu invalid records\n", (unsigned long long)records,
+		(unsigned long long)played, (unsigned long long)moves, (unsigned long long)invalid);
+	for (int i = 0; i < active; i++)
+		free(games[i].positions);
+	for (int i = 0; i <= MAXSIDE; i++)
+		free(layouts[i]);
+	free(games);
+	free(list);
+	if (file != stdin)
+		fclose(file);
+	return 0;
+}
+
+// Run "tournament GAMES [SIDE]": play games of computer against itself on all threads and print statistics
+int TournamentCommand(int argc, char * argv[])
+{
+	// Parse arguments
+	struct tournament * tournament = calloc(1, sizeof(struct tournament));
+	tournament->side = 8;
+	tournament->depth = 6;
+	tournament->hash = HASH;
+	tournament->plies = MAXGAME;
+	tournament->opening = OPENING;
+	tournament->seed = 1;
+	int threads = 1, games = 0;
+	char * logname = NULL, * directory = NULL, * bookname = NULL;
+	for (int i = 0; i < argc; i++)
+	{
+		if (strcmp(argv[i], "--depth") == 0 && i + 1 < argc)
+			tournament->depth = atoi(argv[++i]);
+		else if (strcmp(argv[i], "--time") == 0 && i + 1 < argc)
+			tournament->budget = atoi(argv[++i]);
+		else if (strcmp(argv[i], "--hash") == 0 && i + 1 < argc)
+			tournament->hash = atoi(argv[++i]);
+		else if (strcmp(argv[i], "--threads") == 0 && i + 1 < argc)
+			threads = atoi(argv[++i]);
+		else if (strcmp(argv[i], "--plies") == 0 && i + 1 < argc)
+			tournament->plies = atoi(argv[++i]);
+		else if (strcmp(argv[i], "--opening") == 0 && i + 1 < argc)
+			tournament->opening = atoi(argv[++i]);
+		else if (strcmp(argv[i], "--seed") == 0 && i + 1 < argc)
+			tournament->seed = strtoull(argv[++i], NULL, 10);
+		else if (strcmp(argv[i], "--log") == 0 && i + 1 < argc)
+			logname = argv[++i];
+		else if (strcmp(argv[i], "--tablebase") == 0 && i + 1 < argc)
+			directory = argv[++i];
+		else if (strcmp(argv[i], "--book") == 0 && i + 1 < argc)
+			bookname = argv[++i];
+		else if (strcmp(argv[i], "--clock") == 0 && i + 1 < argc)
+		{
+			if (!ParseClock(argv[++i], &tournament->clock, &tournament->increment))
+				games = -1;
+		}
+		else if (games == 0)
+			games = atoi(argv[i]);
+		else
+			tournament->side = atoi(argv[i]);
+	}
+	if (games < 1 || tournament->depth < 1 || tournament->depth >= MAXPLY || threads < 1 || tournament->plies < 1
+		|| tournament->opening < 0 || tournament->budget < 0)
+	{
+		fprintf(stderr, "Usage: checkers tournament GAMES [SIDE] [--depth N] [--time MS] [--hash MB] [--threads N] "
+			"[--clock MS[+MS]] [--plies N] [--opening N] [--seed N] [--log FILE] [--tablebase DIR] [--book FILE]\n");
+		free(tournament);
+		return 1;
+	}
+	if (CheckSide(tournament->side))
+	{
+		free(tournament);
+		return 1;
+	}
+	tournament->games = games;
+	if (directory != NULL)
+		tournament->tablebase = LoadTablebase(directory, tournament->side);
+	if (bookname != NULL)
+		tournament->book = OpenBook(bookname, tournament->side);
+	if (logname != NULL)
+	{
+		tournament->journal = OpenJournal(logname);
+		if (tournament->journal == NULL)
+		{
+			fprintf(stderr, "Couldn't open log %s\n", logname);
+			free(tournament);
+			return 1;
+		}
+	}
+
+	double time = PlayTournament(tournament, threads);
+
+	printf("%d games (%dx%d, depth %d) in %.3f s, %.2f games/s\n", games, tournament->side, tournament->side,
+		tournament->depth, time, time > 0 ? games / time : 0);
+	printf("white won %d (%.1f%%), drawn %d (%.1f%%), black won %d (%.1f%%)\n",
+		tournament->results[1], 100.0 * tournament->results[1] / games, tournament->results[2], 100.0 * tournament->results[2] / games,
+		tournament->results[0], 100.0 * tournament->results[0] / games);
+	printf("average length %.1f plies, %llu nodes searched, %.0f nodes/s\n", (double)tournament->plays / games,
+		(unsigned long long)tournament->nodes, time > 0 ? tournament->nodes / time : 0);
+	if (tournament->moves > 0)
+	{
+		// Latency of computer's moves
+		size_t moves = tournament->moves;
+		qsort(tournament->times, moves, sizeof(double), CompareTimes);
+		printf("%zu computer's moves: average depth %.1f, %.0f nodes per move, time median %.1f ms, 99%% %.1f ms, max %.1f ms\n",
+			moves, (double)tournament->depths / moves, (double)tournament->nodes / moves, tournament->times[moves / 2] * 1000,
+			tournament->times[moves * 99 / 100] * 1000, tournament->times[moves - 1] * 1000);
+	}
+
+	CloseJournal(tournament->journal);
+	FreeTablebase(tournament->tablebase);
+	CloseBook(tournament->book);
+	pthread_mutex_destroy(&tournament->lock);
+	free(tournament->times);
+	free(tournament);
+	return 0;
+}
+
+// Order of move times: shortest first
+int CompareTimes(const void * a, const void * b)
+{
+	double first = *(const double *)a, second = *(const double *)b;
+	return first < second ? -1 : first > second;
+}
+
+// Play all games of the tournament on the given number of threads and return the time they took in seconds
+double PlayTournament(struct tournament * tournament, int threads)
+{
+	// Every thread plays one game at a time
+	atomic_init(&tournament->next, 0);
+	pthread_mutex_init(&tournament->lock, NULL);
+	pthread_t workers[threads];
+	double start = Now();
+	for (int i = 1; i < threads; i++)
+		pthread_create(&workers[i], NULL, TournamentWorker, tournament);
+	TournamentWorker(tournament);
+	for (int i = 1; i < threads; i++)
+		pthread_join(workers[i], NULL);
+	return Now() - start;
+}
+
+// Play games of the tournament until all are taken
+void * TournamentWorker(void * arg)
+{
+	struct tournament * tournament = arg;
+	while (true)
+	{
+		int index = atomic_fetch_add(&tournament->next, 1);
+		if (index >= tournament->games)
+			break;
+		TournamentGame(tournament, index);
+	}
+
+	return NULL;
+}
+
+// Play one game of the tournament and return its result: 0 - black has won, 1 - white has won, 2 - draw
+int TournamentGame(struct tournament * tournament, int index)
+{
+	struct game * game = calloc(1, sizeof(struct game));
+	game->side = tournament->side;
+	game->headless = true;
+	game->computer[0] = game->computer[1] = true;
+	game->depth = tournament->depth;
+	game->budget = tournament->budget;
+	game->clocked = tournament->clock > 0;
+	game->clock[0] = game->clock[1] = tournament->clock;
+	game->increment = tournament->increment;
+	game->threads = 1;
+	// Own table for every game, so that results do not depend on order of games
+	game->table = CreateTable(tournament->hash);
+	game->tablebase = tournament->tablebase;
+	game->book = tournament->book;
+	game->journal = tournament->journal;
+	if (game->journal != NULL)
+		game->id = atomic_fetch_add(&game->journal->games, 1);
+	InitializeBoard(game);
+	InitializePieces(game);
+
+	// Random moves at the start make games different
+	struct flatmove * list = malloc(sizeof(struct flatmove) * MAXMOVES);
+	uint64_t * hashes = malloc(sizeof(uint64_t) * (tournament->plies + 1));
+	// Games of one seed get different numbers, mixing the seed first keeps games of different seeds apart
+	uint64_t random = Mix(tournament->seed) ^ index;
+	struct bookentry * played = malloc(sizeof(struct bookentry) * (tournament->bookplies + 1));
+	double * times = malloc(sizeof(double) * (tournament->plies + 1));
+	int moves = 0, depths = 0;
+	game->random = Mix(random);
+	int plies = 0, result = 2;
+	while (game->pieces[0] > 0 && game->pieces[1] > 0)
+	{
+		if (IsStucked(game, game->turn % 2))
+			break;
+		// Draw by the length of the game or by the third repetition of the position
+		hashes[plies] = game->position.hash;
+		int repetitions = 0;
+		for (int i = plies; i >= 0; i -= 2)
+			repetitions += hashes[i] == game->position.hash;
+		if (plies >= tournament->plies || repetitions >= 3)
+			break;
+
+		if (plies < tournament->opening)
+		{
+			int count = GenerateMoves(&game->layout, &game->position, list, MAXMOVES);
+			random = Mix(random);
+			PlayMove(game, &list[random % (count < MAXMOVES ? count : MAXMOVES)]);
+		}
+		else if (plies < tournament->bookplies)
+		{
+			// Moves for a new opening book are chosen at random among good ones, the mover is kept in the weight until the result is known
+			random = Mix(random);
+			struct flatmove move = BookCandidate(game, tournament->margin, random);
+			played[plies] = (struct bookentry){game->position.hash, BookKey(&move), game->position.color};
+			PlayMove(game, &move);
+		}
+		else
+		{
+			ComputerMove(game);
+			times[moves++] = game->lasttime;
+			depths += game->lastdepth;
+		}
+		game->turn++;
+		SetColor(&game->position, game->turn % 2);
+		plies++;
+	}
+	if (game->pieces[0] == 0 || game->pieces[1] == 0)
+		result = game->pieces[0] == 0 ? 1 : 0;
+	else if (IsStucked(game, game->turn % 2))
+		result = (game->turn + 1) % 2;
+	LogEnd(game, result);
+
+	pthread_mutex_lock(&tournament->lock);
+	tournament->results[result]++;
+	tournament->plays += plies;
+	tournament->nodes += game->nodes;
+	if (tournament->moves + moves > tournament->space)
+	{
+		tournament->space = (tournament->moves + moves) * 2;
+		tournament->times = realloc(tournament->times, sizeof(double) * tournament->space);
+	}
+	memcpy(tournament->times + tournament->moves, times, sizeof(double) * moves);
+	tournament->moves += moves;
+	tournament->depths += depths;
+	// Moves of the winner weigh 3, of a drawn game 2 and of the loser 1
+	for (int i = tournament->opening; i < plies && i < tournament->bookplies; i++)
+	{
+		if (tournament->count == tournament->capacity)
+		{
+			tournament->capacity = tournament->capacity > 0 ? tournament->capacity * 2 : 1024;
+			tournament->entries = realloc(tournament->entries, sizeof(struct bookentry) * tournament->capacity);
+		}
+		played[i].weight = result == 2 ? 2 : (result == (int)played[i].weight ? 3 : 1);
+		tournament->entries[tournament->count++] = played[i];
+	}
+	pthread_mutex_unlock(&tournament->lock);
+
+	free(played);
+	free(times);
+	free(hashes);
+	free(list);
+	ClearBoard(game);
+	FreeTable(game->table);
+	free(game);
+	return result;
+}
+
+// Put the terminal into raw mode once, so that keys come without waiting for Enter and are not echoed
+void RawMode()
+{
+	if (Terminal.raw || !isatty(STDIN_FILENO) || tcgetattr(STDIN_FILENO, &Terminal.saved) != 0)
+		return;
+
+	struct termios raw = Terminal.saved;
+	raw.c_lflag &= ~(ICANON | ECHO);
+	raw.c_iflag &= ~(ICRNL | IXON);
+	raw.c_cc[VMIN] = 1;
+	raw.c_cc[VTIME] = 0;
+	if (tcsetattr(STDIN_FILENO, TCSAFLUSH, &raw) != 0)
+		return;
+
+	Terminal.raw = true;
+	atexit(RestoreTerminal);
+	signal(SIGINT, Interrupt);
+	signal(SIGTERM, Interrupt);
+}
+
+// Restore settings of the terminal
+void RestoreTerminal()
+{
+	if (!Terminal.raw)
+		return;
+
+	tcsetattr(STDIN_FILENO, TCSAFLUSH, &Terminal.saved);
+	Terminal.raw = false;
+}
+
+// Restore the terminal and stop as the signal asks
+void Interrupt(int signal)
+{
+	tcsetattr(STDIN_FILENO, TCSAFLUSH, &Terminal.saved);
+	write(STDOUT_FILENO, "\e[0m\e[?25h\n", 11);
+	_exit(128 + signal);
+}
+
+// Wait for input for the given time in milliseconds (-1 - without limit), return whether there is some
+bool WaitInput(int timeout)
+{
+	if (Terminal.start < Terminal.length)
+		return true;
+
+	struct pollfd input = {.fd = STDIN_FILENO, .events = POLLIN};
+	return poll(&input, 1, timeout) > 0;
+}
+
+// Return the next byte of input, nokey if there is none in the given time or endkey if input is over
+int ReadByte(int timeout)
+{
+	if (Terminal.start == Terminal.length)
+	{
+		if (!WaitInput(timeout))
+			return nokey;
+		ssize_t length = read(STDIN_FILENO, Terminal.buffer, sizeof(Terminal.buffer));
+		if (length < 0 && errno == EINTR)
+			return nokey;
+		if (length <= 0)
+			return endkey;
+		Terminal.start = 0;
+		Terminal.length = length;
+	}
+
+	return Terminal.buffer[Terminal.start++];
+}
+
+// Return the next key (a character or one of keys), escape sequences of keys are decoded as a whole
+int ReadKey(int timeout)
+{
+	int c = ReadByte(timeout);
+	if (c != escapekey)
+		return c;
+
+	// Esc alone is not followed by [ or O in a short time
+	int next = ReadByte(ESCAPETIME);
+	if (next != '[' && next != 'O')
+	{
+		if (next >= 0)
+			Terminal.start--;
+		return escapekey;
+	}
+
+	// Skip parameters and intermediate bytes up to the final one
+	do
+		c = ReadByte(ESCAPETIME);
+	while (c >= 0x20 && c <= 0x3f);
+
+	switch (c)
+	{
+		case 'A': return upkey;
+		case 'B': return downkey;
+		case 'C': return rightkey;
+		case 'D': return leftkey;
+		default: return otherkey;
+	}
+}
+
+// Read the line and echo it in raw mode, return the key that has ended it: '\n' for Enter or endkey
+// If keys are asked, arrow keys and space end the line too
+int ReadLine(char * line, int size, bool keys)
+{
+	int length = 0;
+	line[0] = 0;
+	fflush(stdout);
+	while (true)
+	{
+		int key = ReadKey(-1);
+		if (key == endkey)
+			return length > 0 ? '\n' : endkey;
+		if (key == '\r' || key == '\n')
+			break;
+		if (keys && ((key >= upkey && key <= leftkey) || key == ' '))
+			return key;
+
+		// Backspace removes the last character
+		if ((key == 127 || key == '\b') && length > 0)
+		{
+			line[--length] = 0;
+			if (Terminal.raw)
+				printf("\b \b");
+		}
+		else if (key >= ' ' && key < 127 && length < size - 1)
+		{
+			line[length++] = key;
+			line[length] = 0;
+			if (Terminal.raw)
+				putchar(key);
+		}
+		fflush(stdout);
+	}
+
+	if (Terminal.raw)
+		printf("\n");
+	return '\n';
+}
+
+// Move the keyboard cursor over dark squares of the board in the direction of the arrow key
+void MoveCursor(struct game * game, int key)
+{
+	struct square * square = game->cursor;
+	int row = game->side / 2, col = game->side / 2;
+	if (square == NULL)
+	{
+		// Cursor appears in the middle of the board
+		if (game->board[row][col] == NULL)
+			col--;
+	}
+	else
+	{
+		row = game->layout.row[square->index];
+		col = game->layout.col[square->index];
+		if (key == leftkey || key == rightkey)
+			col += key == leftkey ? -2 : 2;
+		else
+		{
+			// Squares of the next row are shifted by one, so cursor goes to the right one if there is one
+			row += key == upkey ? -1 : 1;
+			col += col + 1 < game->side ? 1 : -1;
+			if (row >= 0 && row < game->side && game->board[row][col] == NULL)
+				col -= 2;
+		}
+		if (row < 0 || row >= game->side || col < 0 || col >= game->side || game->board[row][col] == NULL)
+			return;
+	}
+
+	if (square != NULL)
+		square->cursor = false;
+	game->cursor = game->board[row][col];
+	game->cursor->cursor = true;
+
+	// Print changed squares and return to the prompt
+	struct cell cells[MAXSIDE][MAXSIDE];
+	SnapshotBoard(game, cells);
+	PrintChanges(game, cells);
+	FrameText(&game->frame, "\e[0m\e[u");
+	FrameFlush(&game->frame);
+}
+
+// Prepare empty tablebase of the board size: numbers of squares and binomial coefficients
+struct tablebase * CreateTablebase(char * directory, int side)
+{
+	struct tablebase * tablebase = calloc(1, sizeof(struct tablebase));
+	InitializeLayout(&tablebase->layout, side);
+	tablebase->directory = directory;
+	for (int bit = 0; bit < MAXBITS; bit++)
+		tablebase->number[bit] = bit < tablebase->layout.bits && BitTest(tablebase->layout.squares, bit) ? tablebase->squares++ : -1;
+	for (int n = 0; n <= MAXBITS; n++)
+	{
+		tablebase->binomial[n][0] = 1;
+		for (int k = 1; k <= TBPIECES; k++)
+			tablebase->binomial[n][k] = n == 0 ? 0 : tablebase->binomial[n - 1][k - 1] + tablebase->binomial[n - 1][k];
+	}
+
+	return tablebase;
+}
+
+// Map all tables of the board size that are in the directory (NULL if there are none)
+struct tablebase * LoadTablebase(char * directory, int side)
+{
+	struct tablebase * tablebase = CreateTablebase(directory, side);
+	for (int code = 0; code < TBMATERIALS; code++)
+	{
+		int counts[4] = {code / 343, code / 49 % 7, code / 7 % 7, code % 7};
+		int pieces = counts[0] + counts[1] + counts[2] + counts[3];
+		if (pieces > TBPIECES || counts[0] + counts[2] == 0 || counts[1] + counts[3] == 0)
+			continue;
+
+		tablebase->files[code] = MapTable(tablebase, counts);
+		if (tablebase->files[code] != NULL)
+		{
+			tablebase->count++;
+			if (pieces > tablebase->pieces)
+				tablebase->pieces = pieces;
+		}
+	}
+
+	if (tablebase->count == 0)
+	{
+		fprintf(stderr, "No tablebase tables of %dx%d board in %s\n", side, side, directory);
+		FreeTablebase(tablebase);
+		return NULL;
+	}
+	return tablebase;
+}
+
+// Unmap tables and free the tablebase
+void FreeTablebase(struct tablebase * tablebase)
+{
+	if (tablebase == NULL)
+		return;
+
+	for (int code = 0; code < TBMATERIALS; code++)
+	{
+		if (tablebase->files[code] != NULL)
+		{
+			munmap((void *)tablebase->files[code]->data, tablebase->files[code]->size);
+			free(tablebase->files[code]);
+		}
+	}
+	free(tablebase);
+}
+
+// Return the code of the material: numbers of black men, white men, black kings and white kings as digits
+int MaterialCode(const int * counts)
+{
+	return ((counts[0] * (TBPIECES + 1) + counts[1]) * (TBPIECES + 1) + counts[2]) * (TBPIECES + 1) + counts[3];
+}
+
+// Write the name of the table file: board size and numbers of pieces in order of their types
+void TableName(const struct tablebase * tablebase, const int * counts, char * name, const char * suffix)
+{
+	sprintf(name, "%s/%d-%d%d%d%d.tb%s", tablebase->directory, tablebase->layout.side, counts[0], counts[1], counts[2], counts[3], suffix);
+}
+
+// Return the number of entries of the table (0 if it is bigger than the limit)
+uint64_t TableSize(const struct tablebase * tablebase, const int * counts)
+{
+	uint64_t size = 2;
+	for (int type = 0; type < 4; type++)
+	{
+		uint64_t combinations = tablebase->binomial[tablebase->squares][counts[type]];
+		if (combinations == 0 || size > TBLIMIT / combinations)
+			return 0;
+		size *= combinations;
+	}
+
+	return size;
+}
+
+// Return the index of the position in the table of its material
+uint64_t TableIndex(const struct tablebase * tablebase, const int * counts, const struct position * position)
+{
+	uint64_t index = 0;
+	for (enum piece type = bman; type <= wking; type++)
+	{
+		// Rank of the combination of squares in colexicographic order
+		struct bitboard pieces = *PieceMask((struct position *)position, type);
+		uint64_t rank = 0;
+		int i = 1;
+		for (int bit = BitPop(&pieces); bit != -1; bit = BitPop(&pieces))
+			rank += tablebase->binomial[tablebase->number[bit]][i++];
+		index = index * tablebase->binomial[tablebase->squares][counts[type]] + rank;
+	}
+
+	return index * 2 + position->color;
+}
+
+// Set up the position of the index, returns false if the arrangement is impossible
+bool DecodeIndex(const struct tablebase * tablebase, const int * counts, uint64_t index, struct position * position)
+{
+	memset(position, 0, sizeof(struct position));
+	position->color = index % 2;
+	index /= 2;
+
+	// Squares are numbered in order of bits
+	short bits[MAXBITS];
+	for (int bit = 0, n = 0; bit < tablebase->layout.bits; bit++)
+	{
+		if (tablebase->number[bit] != -1)
+			bits[n++] = bit;
+	}
+
+	struct bitboard occupied = {};
+	for (enum piece type = wking; type >= bman; type--)
+	{
+		uint64_t combinations = tablebase->binomial[tablebase->squares][counts[type]];
+		uint64_t rank = index % combinations;
+		index /= combinations;
+
+		int square = tablebase->squares - 1;
+		for (int i = counts[type]; i > 0; i--)
+		{
+			while (tablebase->binomial[square][i] > rank)
+				square--;
+			rank -= tablebase->binomial[square][i];
+			int bit = bits[square];
+			// Pieces cannot share squares and men cannot stay on the row where they become kings
+			if (BitTest(occupied, bit) || (type / 2 == 0 && BitTest(tablebase->layout.lastrow[type % 2], bit)))
+				return false;
+			BitSet(&occupied, bit);
+			BitSet(PieceMask(position, type), bit);
+			square--;
+		}
+	}
+
+	return true;
+}
+
+// Map the table file and check it (NULL if there is no such file or it is damaged)
+struct tbfile * MapTable(const struct tablebase * tablebase, const int * counts)
+{
+	char name[strlen(tablebase->directory) + 32];
+	TableName(tablebase, counts, name, "");
+	int descriptor = open(name, O_RDONLY);
+	struct stat info;
+	if (descriptor == -1)
+		return NULL;
+	if (fstat(descriptor, &info) == -1 || info.st_size < TBHEADER + 8)
+	{
+		close(descriptor);
+		return NULL;
+	}
+	const unsigned char * data = mmap(NULL, info.st_size, PROT_READ, MAP_SHARED, descriptor, 0);
+	close(descriptor);
+	if (data == MAP_FAILED)
+		return NULL;
+
+	// Header: magic, version, board size, numbers of pieces, two zero bytes, number of entries and blocks
+	uint64_t entries = 0;
+	uint32_t blocks = 0, crc = 0;
+	for (int i = 0; i < 8; i++)
+		entries |= (uint64_t)data[12 + i] << (i * 8);
+	for (int i = 0; i < 4; i++)
+	{
+		blocks |= (uint32_t)data[20 + i] << (i * 8);
+		crc |= (uint32_t)data[info.st_size - 4 + i] << (i * 8);
+	}
+	bool valid = memcmp(data, TBMAGIC, 4) == 0 && data[4] == TBVERSION && data[5] == tablebase->layout.side;
+	for (int i = 0; i < 4; i++)
+		valid = valid && data[6 + i] == counts[i];
+	valid = valid && entries == TableSize(tablebase, counts) && blocks == (entries + TBBLOCK - 1) / TBBLOCK
+		&& TBHEADER + (blocks + 1) * 4 + 4 <= (uint64_t)info.st_size && crc == Crc32(data, info.st_size - 4);
+	if (!valid)
+	{
+		munmap((void *)data, info.st_size);
+		return NULL;
+	}
+
+	struct tbfile * file = malloc(sizeof(struct tbfile));
+	file->data = data;
+	file->size = info.st_size;
+	file->blocks = blocks;
+	file->offsets = data + TBHEADER;
+	file->runs = file->offsets + (blocks + 1) * 4;
+	return file;
+}
+
+// Return the entry of the table by decompressing its block up to it
+int TableValue(const struct tbfile * file, uint64_t index)
+{
+	const unsigned char * offset = file->offsets + index / TBBLOCK * 4;
+	const unsigned char * run = file->runs + (offset[0] | offset[1] << 8 | offset[2] << 16 | (uint32_t)offset[3] << 24);
+	uint64_t skip = index % TBBLOCK;
+	while (true)
+	{
+		int value = *run++;
+		uint64_t length = 0;
+		for (int shift = 0; ; shift += 7)
+		{
+			length |= (uint64_t)(*run & 127) << shift;
+			if ((*run++ & 128) == 0)
+				break;
+		}
+		if (skip < length)
+			return value;
+		skip -= length;
+	}
+}
+
+// Find the position in the tablebase, returns false if its table is not loaded
+bool ProbeTablebase(const struct tablebase * tablebase, const struct position * position, int * value)
+{
+	int counts[4];
+	for (enum piece type = bman; type <= wking; type++)
+		counts[type] = BitCount(*PieceMask((struct position *)position, type));
+	if (counts[0] + counts[1] + counts[2] + counts[3] > tablebase->pieces || counts[0] + counts[2] == 0 || counts[1] + counts[3] == 0)
+		return false;
+
+	const struct tbfile * file = tablebase->files[MaterialCode(counts)];
+	if (file == NULL)
+		return false;
+	*value = TableValue(file, TableIndex(tablebase, counts, position));
+	return true;
+}
+
+// Return the score of the tablebase entry from the point of view of the side to move
+// (faster wins and slower losses are better)
+int TablebaseScore(int value)
+{
+	if (value == 0)
+		return 0;
+	int distance = value - 1;
+	return distance % 2 == 1 ? TBWIN - distance : -TBWIN + distance;
+}
+
+// Run "tablebase SIDE PIECES [--threads N] [--dir DIR]": solve all materials with up to the given number of pieces
+// Tables that are already in the directory are kept, so that stopped generation continues where it has stopped
+int TablebaseCommand(int argc, char * argv[])
+{
+	// Parse arguments
+	int side = 0, pieces = 0, threads = 1;
+	char * directory = "tablebase";
+	for (int i = 0; i < argc; i++)
+	{
+		if (strcmp(argv[i], "--threads") == 0 && i + 1 < argc)
+			threads = atoi(argv[++i]);
+		else if (strcmp(argv[i], "--dir") == 0 && i + 1 < argc)
+			directory = argv[++i];
+		else if (side == 0)
+			side = atoi(argv[i]);
+		else
+			pieces = atoi(argv[i]);
+	}
+	if (side == 0 || pieces < 2 || pieces > TBPIECES || threads < 1)
+	{
+		fprintf(stderr, "Usage: checkers tablebase SIDE PIECES [--threads N] [--dir DIR] (PIECES is from 2 to %d)\n", TBPIECES);
+		return 1;
+	}
+	if (CheckSide(side))
+		return 1;
+	if (mkdir(directory, 0755) != 0 && errno != EEXIST)
+	{
+		fprintf(stderr, "Couldn't create %s\n", directory);
+		return 1;
+	}
+
+	struct tbgenerator * generator = calloc(1, sizeof(struct tbgenerator));
+	generator->tablebase = CreateTablebase(directory, side);
+	generator->materials = malloc(sizeof(int [4]) * TBMATERIALS);
+	pthread_mutex_init(&generator->lock, NULL);
+	atomic_init(&generator->failed, false);
+	double start = Now();
+
+	// Captures lead to materials with fewer pieces and promotions to ones with fewer men,
+	// so materials with the same numbers of pieces and men do not depend on each other and are solved in parallel
+	for (int total = 2; total <= pieces && !atomic_load(&generator->failed); total++)
+	{
+		for (int men = 0; men <= total && !atomic_load(&generator->failed); men++)
+		{
+			generator->count = 0;
+			for (int black = 0; black <= men; black++)
+			{
+				for (int blackkings = 0; blackkings <= total - men; blackkings++)
+				{
+					int counts[4] = {black, men - black, blackkings, total - men - blackkings};
+					if (counts[0] + counts[2] > 0 && counts[1] + counts[3] > 0)
+						memcpy(generator->materials[generator->count++], counts, sizeof(counts));
+				}
+			}
+
+			atomic_init(&generator->next, 0);
+			pthread_t workers[threads];
+			for (int i = 1; i < threads; i++)
+				pthread_create(&workers[i], NULL, TablebaseWorker, generator);
+			TablebaseWorker(generator);
+			for (int i = 1; i < threads; i++)
+				pthread_join(workers[i], NULL);
+		}
+	}
+
+	bool failed = atomic_load(&generator->failed);
+	if (!failed)
+		printf("%d tables of %dx%d board in %s, %.3f s\n", generator->tablebase->count, side, side, directory, Now() - start);
+	pthread_mutex_destroy(&generator->lock);
+	free(generator->materials);
+	FreeTablebase(generator->tablebase);
+	free(generator);
+	return failed;
+}
+
+// Solve materials of the group until all are taken
+void * TablebaseWorker(void * arg)
+{
+	struct tbgenerator * generator = arg;
+	struct tablebase * tablebase = generator->tablebase;
+	while (!atomic_load(&generator->failed))
+	{
+		int index = atomic_fetch_add(&generator->next, 1);
+		if (index >= generator->count)
+			break;
+
+		int * counts = generator->materials[index];
+		char name[strlen(tablebase->directory) + 32], report[256] = "already solved";
+		TableName(tablebase, counts, name, "");
+		double start = Now();
+
+		// Existing tables are kept
+		struct tbfile * file = MapTable(tablebase, counts);
+		int result = 0;
+		if (file == NULL)
+		{
+			result = SolveTable(tablebase, counts, report);
+			file = result == 0 ? MapTable(tablebase, counts) : NULL;
+			if (result == 0 && file == NULL)
+			{
+				sprintf(report, "couldn't be written");
+				result = 1;
+			}
+		}
+
+		pthread_mutex_lock(&generator->lock);
+		if (file != NULL)
+		{
+			int code = MaterialCode(counts);
+			tablebase->files[code] = file;
+			tablebase->count++;
+			int pieces = counts[0] + counts[1] + counts[2] + counts[3];
+			if (pieces > tablebase->pieces)
+				tablebase->pieces = pieces;
+		}
+		printf("%s: %s, %.3f s\n", name, report, Now() - start);
+		fflush(stdout);
+		pthread_mutex_unlock(&generator->lock);
+		if (result != 0)
+			atomic_store(&generator->failed, true);
+	}
+
+	return NULL;
+}
+
+// Solve every position of the material by retrograde analysis and write its table, returns 0 on success
+// Positions are resolved in order of distance to the end: a position is won if some move leads to a lost one
+// and lost when all its moves lead to won ones; captures and promotions lead to already solved tables
+int SolveTable(struct tablebase * tablebase, const int * counts, char * report)
+{
+	const struct layout * layout = &tablebase->layout;
+	uint64_t entries = TableSize(tablebase, counts);
+	if (entries == 0)
+	{
+		sprintf(report, "too many positions");
+		return 1;
+	}
+
+	unsigned char * values = malloc(entries);
+	memset(values, TBUNKNOWN, entries);
+	uint16_t * remaining = calloc(entries, sizeof(uint16_t)); // moves within the table that are not known to lose
+	unsigned char * longest = calloc(entries, 1); // level of the loss if all remaining moves lose
+	unsigned char * flags = calloc(entries, 1); // 1 - some move leads to a draw, 2 - some move wins, 4 - has to capture
+	struct tbbucket * wins = calloc(TBLEVELS + 1, sizeof(struct tbbucket));
+	struct tbbucket * losses = calloc(TBLEVELS + 1, sizeof(struct tbbucket));
+	struct flatmove * list = malloc(sizeof(struct flatmove) * MAXMOVES);
+	uint32_t * previous = malloc(sizeof(uint32_t) * MAXMOVES);
+	int result = 0;
+
+	// Look at moves of every position: moves within the table are counted, other ones are looked up
+	for (uint64_t index = 0; index < entries && result == 0; index++)
+	{
+		struct position position;
+		if (!DecodeIndex(tablebase, counts, index, &position))
+		{
+			values[index] = TBINVALID;
+			continue;
+		}
+
+		int count = GenerateMoves(layout, &position, list, MAXMOVES);
+		int win = 0;
+		if (count > 0 && BitAny(list[0].captured))
+			flags[index] |= 4;
+		for (int i = 0; i < count && i < MAXMOVES; i++)
+		{
+			if (!BitAny(list[i].captured) && !list[i].promotion)
+			{
+				remaining[index]++;
+				continue;
+			}
+
+			struct position next = position;
+			MakeMove(&next, &list[i]);
+			int value = 1; // side without pieces has lost
+			if (BitAny(next.men[next.color]) || BitAny(next.kings[next.color]))
+			{
+				if (!ProbeTablebase(tablebase, &next, &value))
+				{
+					sprintf(report, "table of a smaller material is missing");
+					result = 1;
+					break;
+				}
+			}
+
+			if (value == 0)
+				flags[index] |= 1;
+			else if ((value - 1) % 2 == 0)
+				win = win == 0 || value < win ? value : win;
+			else if (value > longest[index])
+				longest[index] = value;
+		}
+
+		if (win != 0)
+		{
+			flags[index] |= 2;
+			PushEntry(&wins[win], index);
+		}
+		else if (remaining[index] == 0 && (flags[index] & 1) == 0)
+			PushEntry(&losses[longest[index]], index);
+	}
+
+	// Resolve positions level by level and pass results to the positions that lead to them
+	int longestwin = 0;
+	for (int level = 0; level < TBLEVELS && result == 0; level++)
+	{
+		for (size_t i = 0; i < losses[level].count; i++)
+		{
+			uint32_t index = losses[level].items[i];
+			if (values[index] != TBUNKNOWN)
+				continue;
+			values[index] = level + 1;
+
+			struct position position;
+			DecodeIndex(tablebase, counts, index, &position);
+			int count = Predecessors(tablebase, counts, &position, previous);
+			for (int j = 0; j < count; j++)
+			{
+				// Simple moves are not allowed where there are captures
+				if (values[previous[j]] == TBUNKNOWN && (flags[previous[j]] & 4) == 0)
+					PushEntry(&wins[level + 1], previous[j]);
+			}
+		}
+		for (size_t i = 0; i < wins[level].count; i++)
+		{
+			uint32_t index = wins[level].items[i];
+			if (values[index] != TBUNKNOWN)
+				continue;
+			values[index] = level + 1;
+			longestwin = level;
+
+			struct position position;
+			DecodeIndex(tablebase, counts, index, &position);
+			int count = Predecessors(tablebase, counts, &position, previous);
+			for (int j = 0; j < count; j++)
+			{
+				uint32_t before = previous[j];
+				if (values[before] != TBUNKNOWN || (flags[before] & 4) != 0)
+					continue;
+				remaining[before]--;
+				if (longest[before] < level + 1)
+					longest[before] = level + 1;
+				if (remaining[before] == 0 && flags[before] == 0)
+					PushEntry(&losses[longest[before]], before);
+			}
+		}
+	}
+	if (result == 0 && (wins[TBLEVELS].count > 0 || losses[TBLEVELS].count > 0))
+	{
+		sprintf(report, "distance to the end is longer than %d plies", TBLEVELS - 1);
+		result = 1;
+	}
+
+	// Unsolved positions are draws, impossible ones take the previous value, so that they make longer runs
+	uint64_t stats[3] = {};
+	for (uint64_t index = 0; index < entries && result == 0; index++)
+	{
+		if (values[index] == TBUNKNOWN)
+			values[index] = 0;
+		if (values[index] == TBINVALID)
+			values[index] = index > 0 ? values[index - 1] : 0;
+		else
+			stats[values[index] == 0 ? 2 : (values[index] - 1) % 2]++;
+	}
+	if (result == 0)
+	{
+		result = WriteTable(tablebase, counts, values, entries);
+		sprintf(report, result == 0 ? "%llu positions: %llu won, %llu lost, %llu drawn, longest win %d plies"
+			: "couldn't be written", (unsigned long long)(stats[0] + stats[1] + stats[2]),
+			(unsigned long long)stats[1], (unsigned long long)stats[0], (unsigned long long)stats[2], longestwin);
+	}
+
+	for (int level = 0; level <= TBLEVELS; level++)
+	{
+		free(wins[level].items);
+		free(losses[level].items);
+	}
+	free(wins);
+	free(losses);
+	free(previous);
+	free(list);
+	free(flags);
+	free(longest);
+	free(remaining);
+	free(values);
+	return result;
+}
+
+// Write indices of positions of the same material from which a simple move leads to the position and return their number
+// (some of them may have captures, so that the move is not legal there)
+int Predecessors(const struct tablebase * tablebase, const int * counts, const struct position * position, uint32_t * list)
+{
+	const struct layout * layout = &tablebase->layout;
+	int color = (position->color + 1) % 2;
+	struct bitboard occupied = Occupied(position);
+	int count = 0;
+
+	for (int king = 0; king < 2; king++)
+	{
+		struct bitboard pieces = king ? position->kings[color] : position->men[color];
+		for (int bit = BitPop(&pieces); bit != -1; bit = BitPop(&pieces))
+		{
+			for (int direction = 0; direction < 4; direction++)
+			{
+				// Men come from behind: white men move up the board and black ones down
+				if (!king && (direction < 2) == (color == 1))
+					continue;
+
+				for (int from = layout->adjacent[bit][direction]; from != -1 && !BitTest(occupied, from); from = layout->adjacent[from][direction])
+				{
+					struct position before = *position;
+					struct bitboard * mask = king ? &before.kings[color] : &before.men[color];
+					BitClear(mask, bit);
+					BitSet(mask, from);
+					before.color = color;
+					list[count++] = TableIndex(tablebase, counts, &before);
+					if (!king)
+						break;
+				}
+			}
+		}
+	}
+
+	return count;
+}
+
+// Add the entry to the end of the list
+void PushEntry(struct tbbucket * bucket, uint32_t index)
+{
+	if (bucket->count == bucket->capacity)
+	{
+		bucket->capacity = bucket->capacity > 0 ? bucket->capacity * 2 : 1024;
+		bucket->items = realloc(bucket->items, sizeof(uint32_t) * bucket->capacity);
+	}
+	bucket->items[bucket->count++] = index;
+}
+
+// Compress the table by runs of equal entries in blocks and write it through a temporary file, returns 0 on success
+int WriteTable(const struct tablebase * tablebase, const int * counts, const unsigned char * values, uint64_t entries)
+{
+	uint32_t blocks = (entries + TBBLOCK - 1) / TBBLOCK;
+	// Every entry takes at most 3 bytes
+	size_t capacity = TBHEADER + (blocks + 1) * 4 + entries * 3 + 4;
+	unsigned char * data = calloc(capacity, 1);
+	memcpy(data, TBMAGIC, 4);
+	data[4] = TBVERSION;
+	data[5] = tablebase->layout.side;
+	for (int i = 0; i < 4; i++)
+		data[6 + i] = counts[i];
+	for (int i = 0; i < 8; i++)
+		data[12 + i] = entries >> (i * 8);
+	for (int i = 0; i < 4; i++)
+		data[20 + i] = blocks >> (i * 8);
+
+	unsigned char * offsets = data + TBHEADER;
+	unsigned char * runs = offsets + (blocks + 1) * 4;
+	size_t length = 0;
+	for (uint32_t block = 0; block <= blocks; block++)
+	{
+		for (int i = 0; i < 4; i++)
+			offsets[block * 4 + i] = length >> (i * 8);
+		for (uint64_t index = (uint64_t)block * TBBLOCK; index < entries && index < (uint64_t)(block + 1) * TBBLOCK; )
+		{
+			uint64_t end = index + 1;
+			while (end < entries && end < (uint64_t)(block + 1) * TBBLOCK && values[end] == values[index])
+				end++;
+			runs[length++] = values[index];
+			for (uint64_t run = end - index; ; run >>= 7)
+			{
+				runs[length++] = (run & 127) | (run > 127 ? 128 : 0);
+				if (run <= 127)
+					break;
+			}
+			index = end;
+		}
+	}
+
+	size_t size = runs + length - data;
+	uint32_t crc = Crc32(data, size);
+	for (int i = 0; i < 4; i++)
+		data[size++] = crc >> (i * 8);
+
+	// Table appears under its name only when it is complete
+	char name[strlen(tablebase->directory) + 32], temporary[strlen(tablebase->directory) + 32];
+	TableName(tablebase, counts, name, "");
+	TableName(tablebase, counts, temporary, ".tmp");
+	FILE * file = fopen(temporary, "wb");
+	bool written = file != NULL && fwrite(data, 1, size, file) == size;
+	if (file != NULL)
+		written = fclose(file) == 0 && written;
+	free(data);
+	if (!written || rename(temporary, name) != 0)
+	{
+		remove(temporary);
+		return 1;
+	}
+
+	return 0;
+}
+
+// Run "book GAMES [SIDE] [--plies N] [--margin N] [--output FILE] ...": play games of the computer against itself
+// and write an opening book of moves of their first plies; moves are chosen by search at random among the ones
+// whose score is within the margin of the best, and are weighted by the results of the games
+int BookCommand(int argc, char * argv[])
+{
+	// Parse arguments
+	struct tournament * tournament = calloc(1, sizeof(struct tournament));
+	tournament->side = 8;
+	tournament->depth = 8;
+	tournament->hash = HASH;
+	tournament->plies = MAXGAME;
+	tournament->bookplies = BOOKPLIES;
+	tournament->margin = BOOKMARGIN;
+	tournament->seed = 1;
+	int threads = 1, games = 0;
+	char * output = NULL, name[32];
+	for (int i = 0; i < argc; i++)
+	{
+		if (strcmp(argv[i], "--depth") == 0 && i + 1 < argc)
+			tournament->depth = atoi(argv[++i]);
+		else if (strcmp(argv[i], "--hash") == 0 && i + 1 < argc)
+			tournament->hash = atoi(argv[++i]);
+		else if (strcmp(argv[i], "--threads") == 0 && i + 1 < argc)
+			threads = atoi(argv[++i]);
+		else if (strcmp(argv[i], "--plies") == 0 && i + 1 < argc)
+			tournament->bookplies = atoi(argv[++i]);
+		else if (strcmp(argv[i], "--margin") == 0 && i + 1 < argc)
+			tournament->margin = atoi(argv[++i]);
+		else if (strcmp(argv[i], "--seed") == 0 && i + 1 < argc)
+			tournament->seed = strtoull(argv[++i], NULL, 10);
+		else if (strcmp(argv[i], "--output") == 0 && i + 1 < argc)
+			output = argv[++i];
+		else if (games == 0)
+			games = atoi(argv[i]);
+		else
+			tournament->side = atoi(argv[i]);
+	}
+	if (games < 1 || tournament->depth < 1 || tournament->depth >= MAXPLY || threads < 1 || tournament->bookplies < 1
+		|| tournament->margin < 0)
+	{
+		fprintf(stderr, "Usage: checkers book GAMES [SIDE] [--depth N] [--hash MB] [--threads N] [--plies N] [--margin N] "
+			"[--seed N] [--output FILE]\n");
+		free(tournament);
+		return 1;
+	}
+	if (CheckSide(tournament->side))
+	{
+		free(tournament);
+		return 1;
+	}
+	// Every board size has its own book
+	if (output == NULL)
+	{
+		sprintf(name, "%d.book", tournament->side);
+		output = name;
+	}
+	tournament->games = games;
+
+	double time = PlayTournament(tournament, threads);
+
+	// Same moves of the same positions are merged
+	qsort(tournament->entries, tournament->count, sizeof(struct bookentry), CompareEntries);
+	uint32_t count = 0, positions = 0;
+	for (size_t i = 0; i < tournament->count; i++)
+	{
+		struct bookentry * entry = &tournament->entries[i];
+		if (count > 0 && tournament->entries[count - 1].hash == entry->hash && tournament->entries[count - 1].move == entry->move)
+		{
+			tournament->entries[count - 1].weight += entry->weight;
+			continue;
+		}
+		positions += count == 0 || tournament->entries[count - 1].hash != entry->hash;
+		tournament->entries[count++] = *entry;
+	}
+
+	int result = WriteBook(output, tournament->side, tournament->entries, count);
+	if (result == 0)
+		printf("%d games (%dx%d, depth %d) in %.3f s: %u positions, %u moves in %s\n", games, tournament->side, tournament->side,
+			tournament->depth, time, positions, count, output);
+	else
+		fprintf(stderr, "Couldn't write %s\n", output);
+
+	pthread_mutex_destroy(&tournament->lock);
+	free(tournament->entries);
+	free(tournament);
+	return result;
+}
+
+// Search every move of the game's position and return a random one of those whose score is within the margin of the best
+struct flatmove BookCandidate(struct game * game, int margin, uint64_t random)
+{
+	struct searcher searcher;
+	memset(&searcher, 0, sizeof(struct searcher));
+	searcher.layout = &game->layout;
+	searcher.table = game->table;
+	searcher.tablebase = game->tablebase;
+	searcher.table->generation++;
+	searcher.stack = malloc(sizeof(struct flatmove) * MAXMOVES * MAXPLY);
+	searcher.history = calloc(game->layout.bits * game->layout.bits, sizeof(uint32_t));
+	for (int ply = 0; ply < MAXPLY; ply++)
+		searcher.killers[ply][0] = searcher.killers[ply][1] = -1;
+
+	struct flatmove * list = searcher.stack;
+	int count = GenerateMoves(&game->layout, &game->position, list, MAXMOVES);
+	if (count > MAXMOVES)
+		count = MAXMOVES;
+	int scores[count], best = -WIN - 1;
+	for (int i = 0; i < count && count > 1; i++)
+	{
+		// Moves that are worse than the margin only need to be proven so
+		struct position next = game->position;
+		MakeMove(&next, &list[i]);
+		int alpha = best > -WIN - 1 ? best - margin - 1 : -WIN - 1;
+		scores[i] = -AlphaBeta(&searcher, &next, game->depth - 1, 1, -WIN - 1, -alpha);
+		if (scores[i] > best)
+			best = scores[i];
+	}
+
+	int good = 0;
+	for (int i = 0; i < count; i++)
+	{
+		if (count == 1 || scores[i] >= best - margin)
+			list[good++] = list[i];
+	}
+	struct flatmove move = list[random % good];
+	game->nodes += searcher.nodes;
+	free(searcher.stack);
+	free(searcher.history);
+	return move;
+}
+
+// Order of book entries: by hash, then by move
+int CompareEntries(const void * a, const void * b)
+{
+	const struct bookentry * first = a, * second = b;
+	if (first->hash != second->hash)
+		return first->hash < second->hash ? -1 : 1;
+	return first->move < second->move ? -1 : first->move > second->move;
+}
+
+// Write sorted entries to the book file: header (magic, version, board size, two zero bytes, number of entries,
+// four zero bytes), entries and CRC-32 of everything before it, returns 0 on success
+int WriteBook(const char * filename, int side, const struct bookentry * entries, uint32_t count)
+{
+	size_t size = BOOKHEADER + (size_t)count * BOOKENTRY + 4;
+	unsigned char * data = calloc(size, 1);
+	memcpy(data, BOOKMAGIC, 4);
+	data[4] = BOOKVERSION;
+	data[5] = side;
+	for (int i = 0; i < 4; i++)
+		data[8 + i] = count >> (i * 8);
+	for (uint32_t i = 0; i < count; i++)
+	{
+		unsigned char * entry = data + BOOKHEADER + (size_t)i * BOOKENTRY;
+		for (int j = 0; j < 8; j++)
+			entry[j] = entries[i].hash >> (j * 8);
+		for (int j = 0; j < 4; j++)
+		{
+			entry[8 + j] = entries[i].move >> (j * 8);
+			entry[12 + j] = entries[i].weight >> (j * 8);
+		}
+	}
+	uint32_t crc = Crc32(data, size - 4);
+	for (int i = 0; i < 4; i++)
+		data[size - 4 + i] = crc >> (i * 8);
+
+	FILE * file = fopen(filename, "wb");
+	bool written = file != NULL && fwrite(data, 1, size, file) == size;
+	if (file != NULL)
+		written = fclose(file) == 0 && written;
+	free(data);
+	return !written;
+}
+
+// Map the book file and check it (NULL if it cannot be used for the board size)
+struct book * OpenBook(const char * filename, int side)
+{
+	int descriptor = open(filename, O_RDONLY);
+	struct stat info;
+	if (descriptor == -1 || fstat(descriptor, &info) == -1 || info.st_size < BOOKHEADER + 4)
+	{
+		if (descriptor != -1)
+			close(descriptor);
+		fprintf(stderr, "Couldn't open book %s\n", filename);
+		return NULL;
+	}
+	const unsigned char * data = mmap(NULL, info.st_size, PROT_READ, MAP_SHARED, descriptor, 0);
+	close(descriptor);
+	if (data == MAP_FAILED)
+	{
+		fprintf(stderr, "Couldn't open book %s\n", filename);
+		return NULL;
+	}
+
+	uint32_t count = data[8] | data[9] << 8 | data[10] << 16 | (uint32_t)data[11] << 24;
+	uint32_t crc = 0;
+	for (int i = 0; i < 4; i++)
+		crc |= (uint32_t)data[info.st_size - 4 + i] << (i * 8);
+	if (memcmp(data, BOOKMAGIC, 4) != 0 || data[4] != BOOKVERSION || BOOKHEADER + (uint64_t)count * BOOKENTRY + 4 != (uint64_t)info.st_size
+		|| crc != Crc32(data, info.st_size - 4))
+	{
+		fprintf(stderr, "Book %s is damaged\n", filename);
+		munmap((void *)data, info.st_size);
+		return NULL;
+	}
+	if (data[5] != side)
+	{
+		fprintf(stderr, "Book %s is for %dx%d board\n", filename, data[5], data[5]);
+		munmap((void *)data, info.st_size);
+		return NULL;
+	}
+
+	struct book * book = malloc(sizeof(struct book));
+	book->data = data;
+	book->size = info.st_size;
+	book->count = count;
+	book->entries = data + BOOKHEADER;
+	return book;
+}
+
+// Unmap the book
+void CloseBook(struct book * book)
+{
+	if (book == NULL)
+		return;
+	munmap((void *)book->data, book->size);
+	free(book);
+}
+
+// Return the key of the move in the opening book: hash of its squares, landing squares and captured pieces
+// (MoveKey() is the same for capture sequences that differ only after the first capture)
+uint32_t BookKey(const struct flatmove * move)
+{
+	uint64_t key = Mix((uint64_t)move->from << 32 | (uint64_t)move->to << 16 | (uint64_t)move->length);
+	for (int i = 0; i < move->length && i < MAXPATH; i++)
+		key = Mix(key ^ move->path[i]);
+	for (int i = 0; i < BBWORDS; i++)
+		key = Mix(key ^ move->captured.word[i]);
+	return key;
+}
+
+// Choose a move of the position from the book at random by weights, returns false if the position is not in the book
+bool ProbeBook(const struct book * book, const struct layout * layout, const struct position * position, uint64_t random, struct flatmove * move)
+{
+	// Binary search of the first entry of the position
+	uint32_t low = 0, high = book->count;
+	while (low < high)
+	{
+		uint32_t middle = low + (high - low) / 2;
+		uint64_t hash = 0;
+		for (int i = 0; i < 8; i++)
+			hash |= (uint64_t)book->entries[(size_t)middle * BOOKENTRY + i] << (i * 8);
+		if (hash < position->hash)
+			low = middle + 1;
+		else
+			high = middle;
+	}
+
+	// Moves of the book are matched with legal moves, so that a hash collision cannot make an illegal move
+	struct flatmove * list = malloc(sizeof(struct flatmove) * MAXMOVES);
+	int count = GenerateMoves(layout, position, list, MAXMOVES);
+	if (count > MAXMOVES)
+		count = MAXMOVES;
+	uint64_t total = 0;
+	int found = 0;
+	uint32_t weights[MAXMOVES];
+	for (uint32_t index = low; index < book->count; index++)
+	{
+		const unsigned char * entry = book->entries + (size_t)index * BOOKENTRY;
+		uint64_t hash = 0;
+		uint32_t key = 0, weight = 0;
+		for (int i = 0; i < 8; i++)
+			hash |= (uint64_t)entry[i] << (i * 8);
+		for (int i = 0; i < 4; i++)
+		{
+			key |= (uint32_t)entry[8 + i] << (i * 8);
+			weight |= (uint32_t)entry[12 + i] << (i * 8);
+		}
+		if (hash != position->hash)
+			break;
+
+		// Key that matches more than one legal move cannot tell which of them the book means
+		int match = -1, matches = 0;
+		for (int i = 0; i < count; i++)
+		{
+			if (BookKey(&list[i]) == key)
+			{
+				match = i;
+				matches++;
+			}
+		}
+		if (matches != 1 || match < found)
+			continue;
+
+		struct flatmove tmp = list[found];
+		list[found] = list[match];
+		list[match] = tmp;
+		weights[found++] = weight;
+		total += weight;
+	}
+
+	if (total > 0)
+	{
+		uint64_t choice = random % total;
+		int i = 0;
+		while (choice >= weights[i])
+			choice -= weights[i++];
+		*move = list[i];
+	}
+	free(list);
+	return total > 0;
+}
+
+// Return the widest instruction set of batch evaluation that the processor supports
+enum simd BestSimd()
+{
+#if defined(__x86_64__) || defined(__i386__)
+	if (__builtin_cpu_supports("avx2"))
+		return avx2;
+	if (__builtin_cpu_supports("ssse3"))
+		return sse;
+#endif
+	return portable;
+}
+
+// Batch evaluation scores positions with the same terms as Evaluate, but counts them with popcounts of masks:
+// material is the number of men and kings, and bonuses of men for their squares are summed bit by bit
+// (squares where the bonus has bit k set give 2^k for every man on them). Vector versions score several
+// positions at once with bitboards of one word, bigger boards are scored by the portable version
+
+// Score positions with 64-bit popcounts
+void EvaluatePortable(const struct layout * layout, const struct position * positions, size_t count, int * scores)
+{
+	for (size_t i = 0; i < count; i++)
+	{
+		const struct position * position = &positions[i];
+		int score[2] = {};
+		for (int color = 0; color < 2; color++)
+		{
+			for (int w = 0; w < layout->words; w++)
+			{
+				uint64_t men = position->men[color].word[w];
+				score[color] += MANVALUE * __builtin_popcountll(men) + KINGVALUE * __builtin_popcountll(position->kings[color].word[w]);
+				for (int k = 0; k < EVALPLANES; k++)
+					score[color] += __builtin_popcountll(men & layout->bonus[color][k].word[w]) << k;
+			}
+		}
+		scores[i] = score[position->color] - score[(position->color + 1) % 2];
+	}
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+// Number of set bits in every 64-bit lane: counts of nibbles are looked up by byte shuffle and bytes are summed
+__attribute__((target("avx2"))) static inline __m256i Popcount256(__m256i v)
+{
+	const __m256i lookup = _mm256_setr_epi8(0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4, 0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4);
+	const __m256i nibble = _mm256_set1_epi8(0x0f);
+	__m256i low = _mm256_shuffle_epi8(lookup, _mm256_and_si256(v, nibble));
+	__m256i high = _mm256_shuffle_epi8(lookup, _mm256_and_si256(_mm256_srli_epi16(v, 4), nibble));
+	return _mm256_sad_epu8(_mm256_add_epi8(low, high), _mm256_setzero_si256());
+}
+
+// Score four positions at a time
+__attribute__((target("avx2"))) void EvaluateAvx2(const struct layout * layout, const struct position * positions, size_t count, int * scores)
+{
+	size_t i = 0;
+	for (; i + 4 <= count; i += 4)
+	{
+		const struct position * p = positions + i;
+		__m256i score[2];
+		for (int color = 0; color < 2; color++)
+		{
+			__m256i men = _mm256_setr_epi64x(p[0].men[color].word[0], p[1].men[color].word[0], p[2].men[color].word[0], p[3].men[color].word[0]);
+			__m256i kings = _mm256_setr_epi64x(p[0].kings[color].word[0], p[1].kings[color].word[0], p[2].kings[color].word[0], p[3].kings[color].word[0]);
+			score[color] = _mm256_add_epi64(_mm256_mul_epu32(Popcount256(men), _mm256_set1_epi64x(MANVALUE)),
+				_mm256_mul_epu32(Popcount256(kings), _mm256_set1_epi64x(KINGVALUE)));
+			for (int k = 0; k < EVALPLANES; k++)
+			{
+				__m256i plane = _mm256_set1_epi64x(layout->bonus[color][k].word[0]);
+				score[color] = _mm256_add_epi64(score[color], _mm256_slli_epi64(Popcount256(_mm256_and_si256(men, plane)), k));
+			}
+		}
+
+		// Difference is taken from the point of view of white and turned for black to move
+		int64_t difference[4];
+		_mm256_storeu_si256((__m256i *)difference, _mm256_sub_epi64(score[1], score[0]));
+		for (int j = 0; j < 4; j++)
+			scores[i + j] = p[j].color == 1 ? difference[j] : -difference[j];
+	}
+	EvaluatePortable(layout, positions + i, count - i, scores + i);
+}
+
+// Number of set bits in every 64-bit lane
+__attribute__((target("ssse3"))) static inline __m128i Popcount128(__m128i v)
+{
+	const __m128i lookup = _mm_setr_epi8(0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4);
+	const __m128i nibble = _mm_set1_epi8(0x0f);
+	__m128i low = _mm_shuffle_epi8(lookup, _mm_and_si128(v, nibble));
+	__m128i high = _mm_shuffle_epi8(lookup, _mm_and_si128(_mm_srli_epi16(v, 4), nibble));
+	return _mm_sad_epu8(_mm_add_epi8(low, high), _mm_setzero_si128());
+}
+
+// Score two positions at a time
+__attribute__((target("ssse3"))) void EvaluateSse(const struct layout * layout, const struct position * positions, size_t count, int * scores)
+{
+	size_t i = 0;
+	for (; i + 2 <= count; i += 2)
+	{
+		const struct position * p = positions + i;
+		__m128i score[2];
+		for (int color = 0; color < 2; color++)
+		{
+			__m128i men = _mm_set_epi64x(p[1].men[color].word[0], p[0].men[color].word[0]);
+			__m128i kings = _mm_set_epi64x(p[1].kings[color].word[0], p[0].kings[color].word[0]);
+			score[color] = _mm_add_epi64(_mm_mul_epu32(Popcount128(men), _mm_set1_epi64x(MANVALUE)),
+				_mm_mul_epu32(Popcount128(kings), _mm_set1_epi64x(KINGVALUE)));
+			for (int k = 0; k < EVALPLANES; k++)
+			{
+				__m128i plane = _mm_set1_epi64x(layout->bonus[color][k].word[0]);
+				score[color] = _mm_add_epi64(score[color], _mm_slli_epi64(Popcount128(_mm_and_si128(men, plane)), k));
+			}
+		}
+
+		int64_t difference[2];
+		_mm_storeu_si128((__m128i *)difference, _mm_sub_epi64(score[1], score[0]));
+		for (int j = 0; j < 2; j++)
+			scores[i + j] = p[j].color == 1 ? difference[j] : -difference[j];
+	}
+	EvaluatePortable(layout, positions + i, count - i, scores + i);
+}
+#endif
+
+// Score every position from the point of view of its side to move with the given instruction set
+void EvaluateBatch(const struct layout * layout, const struct position * positions, size_t count, int * scores, enum simd simd)
+{
+#if defined(__x86_64__) || defined(__i386__)
+	if (layout->words == 1 && simd == avx2)
+	{
+		EvaluateAvx2(layout, positions, count, scores);
+		return;
+	}
+	if (layout->words == 1 && simd == sse)
+	{
+		EvaluateSse(layout, positions, count, scores);
+		return;
+	}
+#endif
+	EvaluatePortable(layout, positions, count, scores);
+}
+
+// Run "evaluate [SIDE | FILE] [--positions N] [--rounds N] [--seed N]": score positions of random games
+// one by one with Evaluate and in batches with every supported instruction set, check that scores are the same
+// and print positions per second
+int EvaluateCommand(int argc, char * argv[])
+{
+	// Parse arguments
+	size_t count = EVALPOSITIONS;
+	int rounds = 10;
+	uint64_t random = 1;
+	char * source = "8";
+	for (int i = 0; i < argc; i++)
+	{
+		if (strcmp(argv[i], "--positions") == 0 && i + 1 < argc)
+			count = strtoull(argv[++i], NULL, 10);
+		else if (strcmp(argv[i], "--rounds") == 0 && i + 1 < argc)
+			rounds = atoi(argv[++i]);
+		else if (strcmp(argv[i], "--seed") == 0 && i + 1 < argc)
+			random = strtoull(argv[++i], NULL, 10);
+		else
+			source = argv[i];
+	}
+	if (count < 1 || rounds < 1)
+	{
+		fprintf(stderr, "Usage: checkers evaluate [SIDE | FILE] [--positions N] [--rounds N] [--seed N]\n");
+		return 1;
+	}
+	struct game * game = SetupGame(source);
+	if (game == NULL)
+		return 1;
+	const struct layout * layout = &game->layout;
+
+	// Positions of random games from the starting one
+	struct position * positions = malloc(sizeof(struct position) * count);
+	struct flatmove * list = malloc(sizeof(struct flatmove) * MAXMOVES);
+	struct position position = game->position;
+	for (size_t i = 0; i < count; i++)
+	{
+		int moves = GenerateMoves(layout, &position, list, MAXMOVES);
+		if (moves == 0)
+		{
+			position = game->position;
+			moves = GenerateMoves(layout, &position, list, MAXMOVES);
+		}
+		random = Mix(random);
+		MakeMove(&position, &list[random % (moves < MAXMOVES ? moves : MAXMOVES)]);
+		positions[i] = position;
+	}
+
+	int * expected = malloc(sizeof(int) * count), * scores = malloc(sizeof(int) * count);
+	double start = Now();
+	for (int round = 0; round < rounds; round++)
+	{
+		for (size_t i = 0; i < count; i++)
+			expected[i] = Evaluate(layout, &positions[i]);
+	}
+	double scalar = (Now() - start) / rounds;
+	printf("%zu positions (%dx%d), %d rounds\n", count, layout->side, layout->side, rounds);
+	printf("  scalar: %.0f positions/s\n", count / scalar);
+
+	int result = 0;
+	for (enum simd simd = portable; simd <= BestSimd(); simd++)
+	{
+		start = Now();
+		for (int round = 0; round < rounds; round++)
+			EvaluateBatch(layout, positions, count, scores, simd);
+		double time = (Now() - start) / rounds;
+
+		size_t wrong = 0;
+		for (size_t i = 0; i < count; i++)
+			wrong += scores[i] != expected[i];
+		printf("  batch %s%s: %.0f positions/s, speedup %.2f", SimdName[simd], simd != portable && layout->words > 1 ? " (portable for this board)" : "",
+			count / time, time > 0 ? scalar / time : 0);
+		if (wrong > 0)
+		{
+			printf(", %zu wrong scores", wrong);
+			result = 1;
+		}
+		printf("\n");
+	}
+
+	free(scores);
+	free(expected);
+	free(list);
+	free(positions);
+	ClearBoard(game);
+	free(game);
+	return result;
+}